@@ -0,0 +1,218 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Cheap content analysis used by the "auto" preset - a sample of the rows
+ * is compared pixel by pixel with the neighbour to the left */
+
+#include <string.h>
+
+#include "webp-analyze.h"
+
+#if defined(__SSE2__)
+#  define ANALYZE_SSE2
+#  include <emmintrin.h>
+#endif
+
+/* Only every ANALYSIS_ROW_STEP-th row is examined */
+#define ANALYSIS_ROW_STEP   4
+
+/* Channel difference above which neighbouring pixels form an edge */
+#define EDGE_THRESHOLD      32
+
+/* Open addressing table used to count colours - it holds several times as
+ * many entries as are ever counted so that probes stay short */
+#define COLOR_TABLE_BITS    10
+#define COLOR_TABLE_SIZE    (1 << COLOR_TABLE_BITS)
+
+/* Thresholds for telling graphics from photographs */
+#define GRAPHIC_FLAT_RATIO  0.6   /* screenshots, flat artwork */
+#define PHOTO_FLAT_RATIO    0.02  /* sensor noise leaves almost no flat areas */
+#define TEXT_EDGE_RATIO     0.1
+#define ICON_SIZE           256
+#define ALPHA_ICON_SIZE     512
+
+/* Neighbour comparisons for a set of rows */
+typedef struct {
+    gint64  pixels;
+    gint64  edges;
+    gint64  flats;
+    guint32 alpha;   /* AND of every pixel, so the top byte is the minimum
+                        alpha only when it is 0xff */
+} WebPRowCounts;
+
+/* Plain C version - it also handles the pixels left over by the vector
+ * version at the end of each row */
+void analyze_row_c(const uint32_t *row,
+                   gint            start,
+                   gint            width,
+                   WebPRowCounts  *counts)
+{
+    gint x;
+
+    for (x = MAX(start, 1); x < width; ++x) {
+        uint32_t a = row[x];
+        uint32_t b = row[x - 1];
+        gint     shift;
+        gint     diff = 0;
+
+        for (shift = 0; shift < 32; shift += 8) {
+            diff = MAX(diff, ABS((gint)((a >> shift) & 0xff) -
+                                 (gint)((b >> shift) & 0xff)));
+        }
+
+        counts->edges += diff > EDGE_THRESHOLD;
+        counts->flats += a == b;
+    }
+
+    for (x = start; x < width; ++x) {
+        counts->alpha &= row[x];
+    }
+}
+
+#ifdef ANALYZE_SSE2
+/* Compare four pixels at a time with their left neighbours */
+void analyze_row_sse2(const uint32_t *row,
+                      gint            width,
+                      WebPRowCounts  *counts)
+{
+    static const guint8 bits[16] = { 0, 1, 1, 2, 1, 2, 2, 3,
+                                     1, 2, 2, 3, 2, 3, 3, 4 };
+    const __m128i threshold = _mm_set1_epi8(EDGE_THRESHOLD);
+    const __m128i zero      = _mm_setzero_si128();
+    __m128i       alpha     = _mm_set1_epi8(-1);
+    guint32       lanes[4];
+    gint          x;
+
+    for (x = 1; x + 4 <= width; x += 4) {
+        __m128i a    = _mm_loadu_si128((const __m128i*)(row + x));
+        __m128i b    = _mm_loadu_si128((const __m128i*)(row + x - 1));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+        __m128i over = _mm_subs_epu8(diff, threshold);
+
+        counts->flats += bits[_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b)))];
+        counts->edges += 4 - bits[_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(over, zero)))];
+        alpha = _mm_and_si128(alpha, a);
+    }
+
+    _mm_storeu_si128((__m128i*)lanes, alpha);
+    counts->alpha &= lanes[0] & lanes[1] & lanes[2] & lanes[3];
+
+    /* The first pixel has no neighbour but still counts for alpha */
+    counts->alpha &= row[0];
+
+    analyze_row_c(row, x, width, counts);
+}
+#endif
+
+/* Add the colours of a row to the table, returning FALSE once there are
+ * more than ANALYSIS_MAX_COLORS of them */
+gboolean analyze_colors(const uint32_t *row,
+                        gint            width,
+                        uint32_t       *table,
+                        guint8         *used,
+                        gint           *colors)
+{
+    gint x;
+
+    for (x = 0; x < width; ++x) {
+        uint32_t color = row[x];
+        guint    slot;
+
+        /* Runs of the same colour only need to be counted once */
+        if (x > 0 && color == row[x - 1]) {
+            continue;
+        }
+
+        slot = (color * 0x9E3779B1u) >> (32 - COLOR_TABLE_BITS);
+        while (used[slot] && table[slot] != color) {
+            slot = (slot + 1) & (COLOR_TABLE_SIZE - 1);
+        }
+
+        if (!used[slot]) {
+            used[slot]  = 1;
+            table[slot] = color;
+
+            if (++*colors > ANALYSIS_MAX_COLORS) {
+                return FALSE;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+/* Gather the statistics for an ARGB picture */
+void analyze_picture(const WebPPicture *picture,
+                     WebPAnalysis      *analysis)
+{
+    WebPRowCounts counts = { 0, 0, 0, 0xffffffffu };
+    uint32_t      table[COLOR_TABLE_SIZE];
+    guint8        used[COLOR_TABLE_SIZE];
+    gboolean      counting = TRUE;
+    gint          colors   = 0;
+    gint          y;
+
+    memset(used, 0, sizeof(used));
+
+    for (y = 0; y < picture->height; y += ANALYSIS_ROW_STEP) {
+        const uint32_t *row = picture->argb + (gsize)y * picture->argb_stride;
+
+#ifdef ANALYZE_SSE2
+        analyze_row_sse2(row, picture->width, &counts);
+#else
+        analyze_row_c(row, 0, picture->width, &counts);
+#endif
+        counts.pixels += MAX(picture->width - 1, 0);
+
+        if (counting) {
+            counting = analyze_colors(row, picture->width, table, used, &colors);
+        }
+    }
+
+    analysis->colors     = colors;
+    analysis->edge_ratio = counts.pixels ? (gdouble)counts.edges / counts.pixels : 0.0;
+    analysis->flat_ratio = counts.pixels ? (gdouble)counts.flats / counts.pixels : 0.0;
+    analysis->alpha      = (counts.alpha >> 24) != 0xff;
+}
+
+/* Pick the preset and whether to use lossless encoding - graphics with few
+ * colours or large flat areas compress best losslessly, photographs do not */
+const gchar *analysis_preset(const WebPAnalysis *analysis,
+                             gint                width,
+                             gint                height,
+                             gboolean           *lossless)
+{
+    if (analysis->colors <= ANALYSIS_MAX_COLORS ||
+            analysis->flat_ratio >= GRAPHIC_FLAT_RATIO) {
+        *lossless = TRUE;
+
+        /* Small images, and slightly larger ones with transparency and a
+         * handful of colours, are most likely icons */
+        if ((width <= ICON_SIZE && height <= ICON_SIZE) ||
+                (analysis->alpha && analysis->colors <= ANALYSIS_MAX_COLORS &&
+                 width <= ALPHA_ICON_SIZE && height <= ALPHA_ICON_SIZE)) {
+            return "icon";
+        }
+
+        return analysis->edge_ratio >= TEXT_EDGE_RATIO ? "text" : "drawing";
+    }
+
+    *lossless = FALSE;
+
+    return analysis->flat_ratio < PHOTO_FLAT_RATIO ? "photo" : "picture";
+}
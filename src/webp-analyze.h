@@ -0,0 +1,44 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WEBP_ANALYZE_H__
+#define __WEBP_ANALYZE_H__
+
+#include <glib.h>
+#include <webp/encode.h>
+
+/* Colours counted before an image is considered to have many of them */
+#define ANALYSIS_MAX_COLORS 256
+
+/* Statistics used to pick the encoder settings for an image */
+typedef struct {
+    gint     colors;       /* distinct colours, at most ANALYSIS_MAX_COLORS + 1 */
+    gdouble  edge_ratio;   /* pixels differing sharply from their neighbour */
+    gdouble  flat_ratio;   /* pixels identical to their neighbour */
+    gboolean alpha;        /* any pixel that is not fully opaque */
+} WebPAnalysis;
+
+void analyze_picture(const WebPPicture *picture,
+                     WebPAnalysis      *analysis);
+
+const gchar *analysis_preset(const WebPAnalysis *analysis,
+                             gint                width,
+                             gint                height,
+                             gboolean           *lossless);
+
+#endif /* __WEBP_ANALYZE_H__ */
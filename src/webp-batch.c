@@ -0,0 +1,513 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Command-line converter using the same encoding code and parameters as the
+ * plug-in's export, without starting the GIMP */
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <webp/decode.h>
+#include <webp/encode.h>
+
+#include "config.h"
+#include "webp-codec.h"
+
+/* Rough number of bytes held per pixel while a file is converted: the
+ * decoded input, the ARGB picture and the encoder's own buffers */
+#define BYTES_PER_PIXEL_IN_FLIGHT 16
+
+/* Pixels of an input file */
+typedef struct {
+    gint            width;
+    gint            height;
+    gint            bpp;
+    guchar         *pixels;
+    GDestroyNotify  free_pixels;  /* g_free() or, for libwebp's, free() */
+} BatchImage;
+
+/* State shared between the main thread and the conversion threads */
+typedef struct {
+    const WebPConfig *config;
+    WebPSaveParams   *params;
+    GMutex            mutex;
+    GCond             cond;
+    gint64            in_flight;  /* estimated bytes in use */
+    gint              failures;
+} BatchSync;
+
+/* A single file handed to the conversion threads */
+typedef struct {
+    gchar  *input;
+    gchar  *output;
+    gint64  cost;
+} BatchJob;
+
+gchar    *preset        = "default";
+gboolean  lossless      = FALSE;
+gdouble   quality       = 90.0;
+gdouble   alpha_quality = 100.0;
+gint      time_budget   = 0;
+gint      target_size   = 0;
+gdouble   target_psnr   = 0.0;
+gint      jobs          = 0;
+gint      memory_limit  = 1024;
+gchar    *output_dir    = NULL;
+gchar    *raw_size      = NULL;
+gint      raw_channels  = 4;
+gint      raw_width     = 0;
+gint      raw_height    = 0;
+gboolean  overwrite     = FALSE;
+
+GOptionEntry entries[] = {
+    { "preset",        'p', 0, G_OPTION_ARG_STRING,   &preset,        "Encoder preset: default, auto, picture, photo, drawing, icon or text", "NAME" },
+    { "lossless",      'l', 0, G_OPTION_ARG_NONE,     &lossless,      "Use lossless encoding", NULL },
+    { "quality",       'q', 0, G_OPTION_ARG_DOUBLE,   &quality,       "Quality of the image (default 90)", "Q" },
+    { "alpha-quality", 'a', 0, G_OPTION_ARG_DOUBLE,   &alpha_quality, "Quality of the alpha channel (default 100)", "Q" },
+    { "time-budget",   't', 0, G_OPTION_ARG_INT,      &time_budget,   "Maximum encoding time per file in milliseconds", "MS" },
+    { "target-size",   's', 0, G_OPTION_ARG_INT,      &target_size,   "Target size of each file in bytes", "BYTES" },
+    { "target-psnr",   0,   0, G_OPTION_ARG_DOUBLE,   &target_psnr,   "Target PSNR of each file in dB", "DB" },
+    { "jobs",          'j', 0, G_OPTION_ARG_INT,      &jobs,          "Number of files converted at once (default: one per processor)", "N" },
+    { "memory",        'm', 0, G_OPTION_ARG_INT,      &memory_limit,  "Memory used by files in flight, in MiB (default 1024)", "MIB" },
+    { "output-dir",    'o', 0, G_OPTION_ARG_FILENAME, &output_dir,    "Directory for the output files (default: next to the input)", "DIR" },
+    { "overwrite",     0,   0, G_OPTION_ARG_NONE,     &overwrite,     "Replace input files that are also outputs (such as WebP files converted in place)", NULL },
+    { "raw-size",      0,   0, G_OPTION_ARG_STRING,   &raw_size,      "Dimensions of .raw input files", "WxH" },
+    { "raw-channels",  0,   0, G_OPTION_ARG_INT,      &raw_channels,  "Channels of .raw input files: 3 (RGB) or 4 (RGBA)", "N" },
+    { NULL }
+};
+
+gboolean is_raw(const gchar *filename)
+{
+    return g_str_has_suffix(filename, ".raw") || g_str_has_suffix(filename, ".RAW");
+}
+
+/* Determine the dimensions of an input file without decoding it */
+gboolean probe_image(const gchar *filename,
+                     gint        *width,
+                     gint        *height)
+{
+    GMappedFile *mapped;
+    gboolean     ok;
+
+    if (is_raw(filename)) {
+        *width  = raw_width;
+        *height = raw_height;
+        return raw_width > 0 && raw_height > 0;
+    }
+
+    mapped = g_mapped_file_new(filename, FALSE, NULL);
+    if (!mapped) {
+        return FALSE;
+    }
+
+    ok = WebPGetInfo((const uint8_t*)g_mapped_file_get_contents(mapped),
+                     g_mapped_file_get_length(mapped),
+                     width, height);
+
+    g_mapped_file_unref(mapped);
+
+    /* Anything that is not WebP is left to GdkPixbuf */
+    return ok || gdk_pixbuf_get_file_info(filename, width, height) != NULL;
+}
+
+/* Read the pixels of a WebP, raw or GdkPixbuf-supported file */
+gboolean load_input(const gchar *filename,
+                    BatchImage  *image,
+                    GError     **error)
+{
+    gchar                 *contents;
+    gsize                  length;
+    WebPBitstreamFeatures  features;
+    GdkPixbuf             *pixbuf;
+    gint                   rowstride;
+    gint                   y;
+
+    if (is_raw(filename)) {
+        if (!g_file_get_contents(filename, &contents, &length, error)) {
+            return FALSE;
+        }
+
+        image->width       = raw_width;
+        image->height      = raw_height;
+        image->bpp         = raw_channels;
+        image->pixels      = (guchar*)contents;
+        image->free_pixels = g_free;
+
+        if (length != (gsize)raw_width * raw_height * raw_channels) {
+            g_set_error(error,
+                        G_FILE_ERROR,
+                        0,
+                        "Raw file size does not match %dx%dx%d",
+                        raw_width, raw_height, raw_channels);
+            g_free(contents);
+            return FALSE;
+        }
+
+        return TRUE;
+    }
+
+    if (!g_file_get_contents(filename, &contents, &length, error)) {
+        return FALSE;
+    }
+
+    if (WebPGetFeatures((const uint8_t*)contents, length,
+                        &features) == VP8_STATUS_OK) {
+        uint8_t *pixels;
+
+        /* Opaque images are decoded without an alpha channel */
+        if (features.has_alpha) {
+            pixels = WebPDecodeRGBA((const uint8_t*)contents, length,
+                                    &image->width, &image->height);
+        } else {
+            pixels = WebPDecodeRGB((const uint8_t*)contents, length,
+                                   &image->width, &image->height);
+        }
+
+        g_free(contents);
+
+        if (!pixels) {
+            g_set_error(error,
+                        G_FILE_ERROR,
+                        0,
+                        features.has_animation ?
+                            "Animated WebP files are not supported" :
+                            "Unable to decode WebP file");
+            return FALSE;
+        }
+
+        /* The decoded buffer is used as it is rather than copied */
+        image->bpp         = features.has_alpha ? 4 : 3;
+        image->pixels      = pixels;
+        image->free_pixels = free;
+
+        return TRUE;
+    }
+
+    g_free(contents);
+
+    pixbuf = gdk_pixbuf_new_from_file(filename, error);
+    if (!pixbuf) {
+        return FALSE;
+    }
+
+    if (gdk_pixbuf_get_bits_per_sample(pixbuf) != 8 ||
+            gdk_pixbuf_get_colorspace(pixbuf) != GDK_COLORSPACE_RGB) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    0,
+                    "Only 8-bit RGB(A) images are supported");
+        g_object_unref(pixbuf);
+        return FALSE;
+    }
+
+    image->width       = gdk_pixbuf_get_width(pixbuf);
+    image->height      = gdk_pixbuf_get_height(pixbuf);
+    image->bpp         = gdk_pixbuf_get_n_channels(pixbuf);
+    image->pixels      = g_malloc((gsize)image->width * image->height * image->bpp);
+    image->free_pixels = g_free;
+
+    /* Rows of a pixbuf may be padded */
+    rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    for (y = 0; y < image->height; ++y) {
+        memcpy(image->pixels + (gsize)y * image->width * image->bpp,
+               gdk_pixbuf_get_pixels(pixbuf) + (gsize)y * rowstride,
+               (gsize)image->width * image->bpp);
+    }
+
+    g_object_unref(pixbuf);
+
+    return TRUE;
+}
+
+/* Convert a single file on one of the worker threads */
+void convert_job(gpointer data,
+                 gpointer user_data)
+{
+    BatchJob          *job    = (BatchJob*)data;
+    BatchSync         *sync   = (BatchSync*)user_data;
+    BatchImage         image  = {0};
+    WebPMemoryWriter   memory;
+    GError            *error  = NULL;
+    gboolean           ok;
+    gint64             start  = g_get_monotonic_time();
+
+    WebPMemoryWriterInit(&memory);
+
+    ok = load_input(job->input, &image, &error);
+
+    if (ok) {
+        ok = encode_pixels(sync->config, sync->params, image.pixels,
+                           image.width, image.height, image.bpp,
+                           &memory, NULL, &error);
+        image.free_pixels(image.pixels);
+    }
+
+    /* g_file_set_contents() replaces the file atomically */
+    if (ok) {
+        ok = g_file_set_contents(job->output,
+                                 (const gchar*)memory.mem,
+                                 memory.size,
+                                 &error);
+    }
+
+    g_mutex_lock(&sync->mutex);
+
+    if (ok) {
+        printf("%s -> %s (%lu bytes, %.1f ms)\n",
+               job->input, job->output, (unsigned long)memory.size,
+               (g_get_monotonic_time() - start) / 1000.0);
+    } else {
+        g_printerr("%s: %s\n", job->input, error->message);
+        ++sync->failures;
+    }
+
+    /* Let the main thread start on more files */
+    sync->in_flight -= job->cost;
+    g_cond_broadcast(&sync->cond);
+    g_mutex_unlock(&sync->mutex);
+
+    if (error) {
+        g_error_free(error);
+    }
+
+    WebPMemoryWriterClear(&memory);
+    g_free(job->input);
+    g_free(job->output);
+    g_free(job);
+}
+
+/* Build the name of the output file for an input file */
+gchar *output_filename(const gchar *input)
+{
+    gchar *basename = g_path_get_basename(input);
+    gchar *dirname  = output_dir ? g_strdup(output_dir) : g_path_get_dirname(input);
+    gchar *dot      = strrchr(basename, '.');
+    gchar *name;
+    gchar *output;
+
+    if (dot && dot != basename) {
+        *dot = '\0';
+    }
+
+    name   = g_strconcat(basename, ".webp", NULL);
+    output = g_build_filename(dirname, name, NULL);
+
+    g_free(name);
+    g_free(dirname);
+    g_free(basename);
+
+    return output;
+}
+
+/* Determine whether two names refer to the same existing file */
+gboolean same_file(const gchar *a,
+                   const gchar *b)
+{
+    GStatBuf st_a;
+    GStatBuf st_b;
+
+    if (g_stat(a, &st_a) != 0 || g_stat(b, &st_b) != 0) {
+        return FALSE;
+    }
+
+#ifdef G_OS_WIN32
+    /* Inode numbers are not available on Windows */
+    {
+        gchar    *cwd    = g_get_current_dir();
+        gchar    *full_a = g_path_is_absolute(a) ? g_strdup(a) :
+                           g_build_filename(cwd, a, NULL);
+        gchar    *full_b = g_path_is_absolute(b) ? g_strdup(b) :
+                           g_build_filename(cwd, b, NULL);
+        gboolean  same   = g_ascii_strcasecmp(full_a, full_b) == 0;
+
+        g_free(full_b);
+        g_free(full_a);
+        g_free(cwd);
+        return same;
+    }
+#else
+    return st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+#endif
+}
+
+/* Work out the output of every input before anything is converted -
+ * inputs that would share an output, or replace themselves without
+ * --overwrite, are refused */
+gchar **plan_outputs(gint    count,
+                     gchar **inputs)
+{
+    GHashTable *seen    = g_hash_table_new(g_str_hash, g_str_equal);
+    gchar     **outputs = g_new0(gchar*, count + 1);
+    gboolean    ok      = TRUE;
+    gint        i;
+
+    for (i = 0; i < count; ++i) {
+        const gchar *other;
+
+        outputs[i] = output_filename(inputs[i]);
+        other      = g_hash_table_lookup(seen, outputs[i]);
+
+        if (other) {
+            g_printerr("%s: would be written to %s, as is %s\n",
+                       inputs[i], outputs[i], other);
+            ok = FALSE;
+        } else {
+            g_hash_table_insert(seen, outputs[i], inputs[i]);
+        }
+
+        if (!overwrite && same_file(inputs[i], outputs[i])) {
+            g_printerr("%s: would replace itself (use --overwrite)\n",
+                       inputs[i]);
+            ok = FALSE;
+        }
+    }
+
+    g_hash_table_destroy(seen);
+
+    if (!ok) {
+        g_strfreev(outputs);
+        outputs = NULL;
+    }
+
+    return outputs;
+}
+
+int main(int   argc,
+         char *argv[])
+{
+    GOptionContext *context;
+    GError         *error  = NULL;
+    WebPSaveParams  params = {0};
+    WebPConfig      config;
+    BatchSync       sync;
+    GThreadPool    *pool;
+    gchar         **outputs;
+    gint64          budget;
+    gint            i;
+
+    context = g_option_context_new("FILE...");
+    g_option_context_set_summary(context,
+        "Convert images to WebP with the same settings as the GIMP plug-in. "
+        "Inputs may be WebP files, raw RGB(A) files ending in .raw (see "
+        "--raw-size) or any format supported by GdkPixbuf.");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    if (argc < 2) {
+        g_printerr("No input files\n");
+        return 1;
+    }
+
+    if (raw_size && (sscanf(raw_size, "%dx%d", &raw_width, &raw_height) != 2 ||
+                     raw_width <= 0 || raw_height <= 0)) {
+        g_printerr("Invalid raw size '%s'\n", raw_size);
+        return 1;
+    }
+
+    if (raw_channels != 3 && raw_channels != 4) {
+        g_printerr("Raw files must have 3 or 4 channels\n");
+        return 1;
+    }
+
+    /* Fill in the same parameters as the export dialog */
+    params.preset        = preset;
+    params.lossless      = lossless;
+    params.quality       = quality;
+    params.alpha_quality = alpha_quality;
+    params.time_budget   = time_budget;
+    params.target_size   = target_size;
+    params.target_psnr   = target_psnr;
+
+    webp_config_from_params(&config, &params);
+
+    /* Files are converted concurrently - libwebp's own threads would only
+     * compete with them */
+    config.thread_level = 0;
+
+    if (!WebPValidateConfig(&config)) {
+        g_printerr("Invalid encoder settings\n");
+        return 1;
+    }
+
+    outputs = plan_outputs(argc - 1, argv + 1);
+    if (!outputs) {
+        return 1;
+    }
+
+    if (jobs <= 0) {
+        jobs = MAX(g_get_num_processors(), 1);
+    }
+
+    budget = (gint64)MAX(memory_limit, 1) * 1024 * 1024;
+
+    sync.config    = &config;
+    sync.params    = &params;
+    sync.in_flight = 0;
+    sync.failures  = 0;
+    g_mutex_init(&sync.mutex);
+    g_cond_init(&sync.cond);
+
+    pool = g_thread_pool_new(convert_job, &sync, jobs, FALSE, NULL);
+
+    for (i = 1; i < argc; ++i) {
+        BatchJob *job;
+        gint      width;
+        gint      height;
+
+        if (!probe_image(argv[i], &width, &height)) {
+            g_printerr("%s: unrecognized or unreadable image\n", argv[i]);
+            ++sync.failures;
+            continue;
+        }
+
+        job = g_new0(BatchJob, 1);
+        job->input  = g_strdup(argv[i]);
+        job->output = g_strdup(outputs[i - 1]);
+        job->cost   = (gint64)width * height * BYTES_PER_PIXEL_IN_FLIGHT;
+
+        /* Wait until the file fits within the memory budget - a file that
+         * exceeds the budget on its own is converted by itself */
+        g_mutex_lock(&sync.mutex);
+        while (sync.in_flight > 0 && sync.in_flight + job->cost > budget) {
+            g_cond_wait(&sync.cond, &sync.mutex);
+        }
+        sync.in_flight += job->cost;
+        g_mutex_unlock(&sync.mutex);
+
+        g_thread_pool_push(pool, job, NULL);
+    }
+
+    /* Wait for every file to finish */
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    g_cond_clear(&sync.cond);
+    g_mutex_clear(&sync.mutex);
+    g_strfreev(outputs);
+
+    return sync.failures ? 1 : 0;
+}
@@ -0,0 +1,769 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark for the encoding and decoding code of the plug-in, run outside
+ * of the GIMP - pixels are taken from memory instead of a drawable, so the
+ * figures cover everything save_layer(), save_animation(), load_image() and
+ * load_animation() do apart from transferring pixels to and from the GIMP */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <webp/decode.h>
+#include <webp/demux.h>
+#include <webp/encode.h>
+
+#ifdef G_OS_UNIX
+#  include <sys/resource.h>
+#endif
+
+#include "config.h"
+#include "webp-codec.h"
+#include "webp-convert.h"
+#include "webp-stats.h"
+#include "webp-writer.h"
+
+/* Rows handed to the encoder at a time - the GIMP's default tile height,
+ * which read_layer() reads strips of */
+#define STRIP_HEIGHT 64
+
+/* A synthetic or on-disk image held in memory */
+typedef struct {
+    gchar          *name;
+    gint            width;
+    gint            height;
+    gint            bpp;
+    guchar         *pixels;
+    GDestroyNotify  free_pixels;  /* g_free() or, for libwebp's, free() */
+} BenchImage;
+
+/* Latencies and output of a single configuration */
+typedef struct {
+    gdouble *times;   /* milliseconds */
+    gint     count;
+    gsize    bytes;
+} BenchResult;
+
+gint      iterations = 5;
+gint      frames     = 100;
+gboolean  large      = FALSE;
+gdouble   quality    = 90.0;
+gchar    *preset     = "default";
+gboolean  first      = TRUE;
+
+GOptionEntry entries[] = {
+    { "iterations", 'n', 0, G_OPTION_ARG_INT,    &iterations, "Runs per configuration (default 5)", "N" },
+    { "frames",     'f', 0, G_OPTION_ARG_INT,    &frames,     "Frames in the synthetic animation (default 100)", "N" },
+    { "large",      'l', 0, G_OPTION_ARG_NONE,   &large,      "Include 8K synthetic images, with and without alpha", NULL },
+    { "quality",    'q', 0, G_OPTION_ARG_DOUBLE, &quality,    "Quality of lossy configurations (default 90)", "Q" },
+    { "preset",     'p', 0, G_OPTION_ARG_STRING, &preset,     "Encoder preset (default \"default\")", "NAME" },
+    { NULL }
+};
+
+/* Retrieve the peak resident set size of the process in KiB, or -1 */
+glong peak_rss(void)
+{
+#ifdef G_OS_UNIX
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#  ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#  else
+        return usage.ru_maxrss;
+#  endif
+    }
+#endif
+    return -1;
+}
+
+int compare_doubles(const void *a,
+                    const void *b)
+{
+    gdouble x = *(const gdouble*)a;
+    gdouble y = *(const gdouble*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of the (sorted) latencies */
+gdouble percentile(BenchResult *result,
+                   gdouble      p)
+{
+    gint rank = (gint)ceil(p * result->count) - 1;
+
+    return result->times[CLAMP(rank, 0, result->count - 1)];
+}
+
+/* Print one configuration as a JSON object - the peak RSS is the high-water
+ * mark of the whole process up to this point */
+void report(const gchar *image,
+            const gchar *operation,
+            const gchar *config,
+            gint         width,
+            gint         height,
+            gint         nframes,
+            BenchResult *result)
+{
+    GString *json;
+    gdouble  p50;
+    gdouble  megapixels;
+
+    qsort(result->times, result->count, sizeof(gdouble), compare_doubles);
+
+    p50        = percentile(result, 0.50);
+    megapixels = (gdouble)width * height * nframes / 1e6;
+
+    /* Names may come from the command line, so they are escaped */
+    json = g_string_new("{\"image\": ");
+    json_append_string(json, image);
+    g_string_append(json, ", \"operation\": ");
+    json_append_string(json, operation);
+    g_string_append(json, ", \"config\": ");
+    json_append_string(json, config);
+
+    printf("%s\n    %s, "
+           "\"width\": %d, \"height\": %d, \"frames\": %d, \"bytes\": %lu, "
+           "\"megapixels_per_second\": %.3f, \"p50_ms\": %.3f, \"p95_ms\": %.3f, "
+           "\"peak_rss_kb\": %ld}",
+           first ? "" : ",",
+           json->str,
+           width, height, nframes,
+           (unsigned long)result->bytes,
+           p50 > 0 ? megapixels / (p50 / 1000.0) : 0.0,
+           p50,
+           percentile(result, 0.95),
+           peak_rss());
+    fflush(stdout);
+
+    g_string_free(json, TRUE);
+
+    first = FALSE;
+}
+
+/* Smooth gradients with sensor-like noise */
+void fill_photo(BenchImage *image,
+                GRand      *rand,
+                gint        phase)
+{
+    gint x;
+    gint y;
+
+    for (y = 0; y < image->height; ++y) {
+        guchar *row = image->pixels + (gsize)y * image->width * image->bpp;
+
+        for (x = 0; x < image->width; ++x) {
+            gint    noise = g_rand_int_range(rand, -8, 9);
+            guchar *p     = row + x * image->bpp;
+
+            p[0] = CLAMP((x + phase) * 255 / image->width + noise, 0, 255);
+            p[1] = CLAMP(y * 255 / image->height + noise, 0, 255);
+            p[2] = CLAMP(128 + 100 * sin((x + y + phase) / 40.0) + noise, 0, 255);
+
+            /* A soft disc of opacity in the middle of the image */
+            if (image->bpp == 4) {
+                gdouble dx = (x - image->width / 2.0) / image->width;
+                gdouble dy = (y - image->height / 2.0) / image->height;
+
+                p[3] = CLAMP(255 - 600 * (dx * dx + dy * dy), 0, 255);
+            }
+        }
+    }
+}
+
+/* Flat regions with hard edges and a handful of colors */
+void fill_drawing(BenchImage *image,
+                  GRand      *rand)
+{
+    const guint32 palette[] = { 0xffffff, 0x202020, 0xd03030, 0x3060c0,
+                                0xf0c020, 0x40a040 };
+    gint          i;
+    gint          x;
+    gint          y;
+
+    memset(image->pixels, 0xff, (gsize)image->width * image->height * image->bpp);
+
+    for (i = 0; i < 200; ++i) {
+        guint32 color = palette[g_rand_int_range(rand, 0, G_N_ELEMENTS(palette))];
+        gint    x0    = g_rand_int_range(rand, 0, image->width);
+        gint    y0    = g_rand_int_range(rand, 0, image->height);
+        gint    x1    = x0 + g_rand_int_range(rand, 4, image->width / 4);
+        gint    y1    = y0 + g_rand_int_range(rand, 4, image->height / 4);
+
+        /* Clamped separately - MIN() would draw the random numbers twice */
+        x1 = MIN(x1, image->width);
+        y1 = MIN(y1, image->height);
+
+        for (y = y0; y < y1; ++y) {
+            guchar *p = image->pixels + ((gsize)y * image->width + x0) * image->bpp;
+
+            for (x = x0; x < x1; ++x, p += image->bpp) {
+                p[0] = color >> 16;
+                p[1] = color >> 8;
+                p[2] = color;
+            }
+        }
+    }
+}
+
+BenchImage *image_new(const gchar *kind,
+                      gint         width,
+                      gint         height,
+                      gint         bpp)
+{
+    BenchImage *image = g_new0(BenchImage, 1);
+
+    image->name   = g_strdup_printf("%s-%dx%d", kind, width, height);
+    image->width  = width;
+    image->height = height;
+    image->bpp         = bpp;
+    image->pixels      = g_malloc((gsize)width * height * bpp);
+    image->free_pixels = g_free;
+
+    return image;
+}
+
+void image_free(BenchImage *image)
+{
+    image->free_pixels(image->pixels);
+    g_free(image->name);
+    g_free(image);
+}
+
+/* Copy a strip of rows from the image standing in for the drawable */
+gboolean read_image_strip(guchar   *buffer,
+                          gint      y,
+                          gint      nrows,
+                          gpointer  user_data)
+{
+    BenchImage *image  = (BenchImage*)user_data;
+    gsize       stride = (gsize)image->width * image->bpp;
+
+    memcpy(buffer, image->pixels + y * stride, nrows * stride);
+
+    return TRUE;
+}
+
+/* Encode an image the way save_layer() does - pixels are read in strips
+ * into the picture, then encoded through the encode cache (when enabled by
+ * GIMP_WEBP_CACHE_SIZE) while statistics are collected */
+gboolean encode_image(BenchImage           *image,
+                      const WebPConfig     *config,
+                      const WebPSaveParams *params,
+                      WebPMemoryWriter     *memory)
+{
+    WebPPicture picture;
+    WebPStats   stats = {{0}};
+    gboolean    ok;
+
+    WebPPictureInit(&picture);
+    picture.writer        = WebPMemoryWrite;
+    picture.custom_ptr    = memory;
+    picture.progress_hook = webp_deadline_progress;
+
+    ok = read_strips(&picture, image->width, image->height, image->bpp,
+                     STRIP_HEIGHT, read_image_strip, image, NULL,
+                     &stats, NULL) &&
+         encode_picture(config, &picture, params, image->bpp == 4,
+                        &stats, NULL);
+
+    WebPPictureFree(&picture);
+
+    return ok;
+}
+
+/* Copy a strip of decoded rows into the buffer standing in for the layer */
+void copy_rows(const uint8_t *rows,
+               gint           y,
+               gint           nrows,
+               gint           stride,
+               gpointer       user_data)
+{
+    memcpy((guchar*)user_data + (gsize)y * stride, rows, (gsize)nrows * stride);
+}
+
+/* Decode a bitstream the way create_layer() does */
+gboolean decode_image(const uint8_t *data,
+                      size_t         data_size,
+                      guchar        *layer)
+{
+    WebPBitstreamFeatures features;
+
+    if (WebPGetFeatures(data, data_size, &features) != VP8_STATUS_OK) {
+        return FALSE;
+    }
+
+    return decode_incremental(data, data_size,
+                              features.has_alpha,
+                              features.width, features.height,
+                              copy_rows, layer) == VP8_STATUS_OK;
+}
+
+/* Time encoding and decoding an image under one configuration */
+void bench_image(BenchImage     *image,
+                 WebPSaveParams *params,
+                 const gchar    *config_name)
+{
+    WebPConfig        config;
+    WebPMemoryWriter  memory;
+    BenchResult       result;
+    guchar           *layer;
+    gint              i;
+
+    webp_config_from_params(&config, params);
+
+    result.times = g_new(gdouble, iterations);
+    result.count = 0;
+    result.bytes = 0;
+
+    WebPMemoryWriterInit(&memory);
+
+    for (i = 0; i < iterations; ++i) {
+        gint64 start;
+
+        WebPMemoryWriterClear(&memory);
+        WebPMemoryWriterInit(&memory);
+
+        start = g_get_monotonic_time();
+        if (!encode_image(image, &config, params, &memory)) {
+            g_printerr("Unable to encode %s (%s)\n", image->name, config_name);
+            break;
+        }
+        result.times[result.count++] = (g_get_monotonic_time() - start) / 1000.0;
+        result.bytes = memory.size;
+    }
+
+    if (result.count == iterations) {
+        report(image->name, "encode", config_name,
+               image->width, image->height, 1, &result);
+
+        /* The decoder produces RGBA at most */
+        layer = g_malloc((gsize)image->width * image->height * 4);
+        result.count = 0;
+
+        for (i = 0; i < iterations; ++i) {
+            gint64 start = g_get_monotonic_time();
+
+            if (!decode_image(memory.mem, memory.size, layer)) {
+                g_printerr("Unable to decode %s (%s)\n", image->name, config_name);
+                break;
+            }
+            result.times[result.count++] = (g_get_monotonic_time() - start) / 1000.0;
+        }
+
+        if (result.count == iterations) {
+            report(image->name, "decode", config_name,
+                   image->width, image->height, 1, &result);
+        }
+
+        g_free(layer);
+    }
+
+    WebPMemoryWriterClear(&memory);
+    g_free(result.times);
+}
+
+/* Time converting an image's rows to ARGB with each set of converters the
+ * processor supports, as import_rows() does before encoding */
+void bench_convert(BenchImage *image)
+{
+    const ConvertKernels *kernels;
+    gint                  count = convert_get_kernels(&kernels);
+    BenchResult           result;
+    uint32_t             *argb;
+    gint                  k;
+    gint                  i;
+    gint                  y;
+
+    argb         = g_new(uint32_t, image->width);
+    result.times = g_new(gdouble, iterations);
+    result.bytes = (gsize)image->width * image->height * 4;
+
+    for (k = 0; k < count; ++k) {
+        result.count = 0;
+
+        for (i = 0; i < iterations; ++i) {
+            gint64 start = g_get_monotonic_time();
+
+            for (y = 0; y < image->height; ++y) {
+                const guchar *row = image->pixels +
+                                    (gsize)y * image->width * image->bpp;
+
+                if (image->bpp == 4) {
+                    kernels[k].rgba(row, argb, image->width);
+                } else {
+                    kernels[k].rgb(row, argb, image->width);
+                }
+            }
+            result.times[result.count++] = (g_get_monotonic_time() - start) / 1000.0;
+        }
+
+        report(image->name, "convert", kernels[k].name,
+               image->width, image->height, 1, &result);
+    }
+
+    g_free(result.times);
+    g_free(argb);
+}
+
+/* Encode and decode each image under the lossy and lossless settings, with
+ * and without libwebp's threads */
+void bench_configs(BenchImage *image)
+{
+    WebPSaveParams params = {0};
+    gchar          name[64];
+
+    params.preset        = preset;
+    params.quality       = quality;
+    params.alpha_quality = 100.0f;
+    params.threads       = TRUE;
+
+    bench_convert(image);
+
+    g_snprintf(name, sizeof(name), "lossy-%s-q%g", preset, quality);
+    bench_image(image, &params, name);
+
+    params.threads = FALSE;
+    g_snprintf(name, sizeof(name), "lossy-%s-q%g-serial", preset, quality);
+    bench_image(image, &params, name);
+
+    params.lossless = TRUE;
+    g_snprintf(name, sizeof(name), "lossless-%s-q%g-serial", preset, quality);
+    bench_image(image, &params, name);
+
+    params.threads = TRUE;
+    g_snprintf(name, sizeof(name), "lossless-%s-q%g", preset, quality);
+    bench_image(image, &params, name);
+}
+
+#ifdef WEBP_0_5
+/* Copy a decoded frame into the buffer standing in for its layer */
+gboolean copy_frame(gint           index,
+                    const uint8_t *rgba,
+                    gint           width,
+                    gint           height,
+                    gboolean       alpha,
+                    gint           offsetx,
+                    gint           offsety,
+                    gpointer       user_data)
+{
+    memcpy(user_data, rgba, (gsize)width * height * (alpha ? 4 : 3));
+
+    return TRUE;
+}
+
+/* Decode every frame one after another with WebPDecodeRGBA(), as the
+ * plug-in did before load_animation() used a thread pool - the baseline
+ * the pool is compared against */
+gboolean decode_frames_serial(WebPDemuxer *demux,
+                              guchar      *layer)
+{
+    WebPIterator iter;
+    gboolean     ok;
+
+    if (!WebPDemuxGetFrame(demux, 1, &iter)) {
+        return FALSE;
+    }
+
+    do {
+        int      width;
+        int      height;
+        uint8_t *rgba = WebPDecodeRGBA(iter.fragment.bytes,
+                                       iter.fragment.size,
+                                       &width, &height);
+
+        ok = rgba != NULL;
+        if (ok) {
+            memcpy(layer, rgba, (gsize)width * height * 4);
+            free(rgba);
+        }
+    } while (ok && WebPDemuxNextFrame(&iter));
+
+    WebPDemuxReleaseIterator(&iter);
+
+    return ok;
+}
+
+/* Encode an animation the way encode_frames_parallel() muxes it - every
+ * frame is a keyframe streamed through the asynchronous writer into a
+ * temporary file that is discarded afterwards - then decode its frames */
+void bench_animation(gint width,
+                     gint height)
+{
+    WebPSaveParams    params = {0};
+    WebPConfig        config;
+    BenchImage      **images;
+    BenchResult       result;
+    GRand            *rand;
+    gchar            *filename;
+    gchar            *name;
+    gint              i;
+    gint              j;
+
+    params.preset        = preset;
+    params.quality       = quality;
+    params.alpha_quality = 100.0f;
+    params.loop          = TRUE;
+
+    webp_config_from_params(&config, &params);
+
+    /* Moving content, so that every frame differs */
+    rand   = g_rand_new_with_seed(2);
+    images = g_new(BenchImage*, frames);
+    for (i = 0; i < frames; ++i) {
+        images[i] = image_new("frame", width, height, 4);
+        fill_photo(images[i], rand, i * 8);
+    }
+    g_rand_free(rand);
+
+    name     = g_strdup_printf("animation-%dx%dx%d", width, height, frames);
+    filename = g_build_filename(g_get_tmp_dir(), "webp-bench.webp", NULL);
+
+    result.times = g_new(gdouble, iterations);
+    result.count = 0;
+    result.bytes = 0;
+
+    for (i = 0; i < iterations; ++i) {
+        WebPAsyncWriter *outfile;
+        WebPAnimStream   stream;
+        gboolean         ok;
+        gint64           start = g_get_monotonic_time();
+
+        outfile = async_writer_open(filename, NULL);
+        ok = outfile && anim_stream_begin(&stream, outfile, width, height, TRUE, NULL);
+
+        for (j = 0; j < frames && ok; ++j) {
+            WebPMemoryWriter memory;
+
+            WebPMemoryWriterInit(&memory);
+            ok = encode_image(images[j], &config, &params, &memory) &&
+                    anim_stream_add_frame(&stream, memory.mem, memory.size,
+                                          width, height, FRAME_DURATION, TRUE,
+                                          NULL);
+            WebPMemoryWriterClear(&memory);
+        }
+
+        ok = ok && anim_stream_end(&stream, NULL);
+
+        if (outfile) {
+            result.bytes = async_writer_get_size(outfile);
+            ok = async_writer_close(outfile, ok, NULL) && ok;
+        }
+
+        if (!ok) {
+            g_printerr("Unable to encode %s\n", name);
+            break;
+        }
+        result.times[result.count++] = (g_get_monotonic_time() - start) / 1000.0;
+    }
+
+    if (result.count == iterations) {
+        gchar  *contents;
+        gsize   length;
+        guchar *layer = g_malloc((gsize)width * height * 4);
+
+        report(name, "encode", "lossy-keyframes",
+               width, height, frames, &result);
+
+        /* Decode every frame on the thread pool load_animation() uses */
+        if (g_file_get_contents(filename, &contents, &length, NULL)) {
+            WebPData     wp_data = { (const uint8_t*)contents, length };
+            WebPDemuxer *demux   = WebPDemux(&wp_data);
+
+            result.count = 0;
+
+            for (i = 0; demux && i < iterations; ++i) {
+                gint64   start = g_get_monotonic_time();
+                gboolean ok    = decode_frames(demux, copy_frame, layer,
+                                               NULL, NULL);
+
+                if (!ok) {
+                    g_printerr("Unable to decode %s\n", name);
+                    break;
+                }
+                result.times[result.count++] = (g_get_monotonic_time() - start) / 1000.0;
+            }
+
+            if (result.count == iterations) {
+                report(name, "decode", "lossy-keyframes",
+                       width, height, frames, &result);
+            }
+
+            /* ...and serially, for comparison */
+            result.count = 0;
+
+            for (i = 0; demux && i < iterations; ++i) {
+                gint64 start = g_get_monotonic_time();
+
+                if (!decode_frames_serial(demux, layer)) {
+                    g_printerr("Unable to decode %s\n", name);
+                    break;
+                }
+                result.times[result.count++] = (g_get_monotonic_time() - start) / 1000.0;
+            }
+
+            if (result.count == iterations) {
+                report(name, "decode", "lossy-keyframes-serial",
+                       width, height, frames, &result);
+            }
+
+            WebPDemuxDelete(demux);
+            g_free(contents);
+        }
+
+        g_free(layer);
+    }
+
+    g_unlink(filename);
+
+    for (i = 0; i < frames; ++i) {
+        image_free(images[i]);
+    }
+
+    g_free(result.times);
+    g_free(images);
+    g_free(filename);
+    g_free(name);
+}
+#endif
+
+/* Load a WebP file from disk for re-encoding - the first frame is used */
+BenchImage *image_from_file(const gchar *filename)
+{
+    BenchImage *image = NULL;
+    gchar      *contents;
+    gsize       length;
+    gchar      *basename;
+    int         width;
+    int         height;
+    uint8_t    *rgba;
+
+    if (!g_file_get_contents(filename, &contents, &length, NULL)) {
+        return NULL;
+    }
+
+    rgba = WebPDecodeRGBA((const uint8_t*)contents, length, &width, &height);
+    if (rgba) {
+        basename = g_path_get_basename(filename);
+
+        /* The decoded buffer is used as it is rather than copied */
+        image = g_new0(BenchImage, 1);
+        image->name        = g_strdup_printf("file-%s", basename);
+        image->width       = width;
+        image->height      = height;
+        image->bpp         = 4;
+        image->pixels      = rgba;
+        image->free_pixels = free;
+
+        g_free(basename);
+    }
+
+    g_free(contents);
+
+    return image;
+}
+
+int main(int   argc,
+         char *argv[])
+{
+    GOptionContext *context;
+    GError         *error = NULL;
+    GRand          *rand;
+    BenchImage     *image;
+    gint            i;
+
+    context = g_option_context_new("[FILE.webp...]");
+    g_option_context_set_summary(context,
+        "Measure encoding and decoding performance on synthetic images and "
+        "the WebP files provided, printing the results as JSON.");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    iterations = MAX(iterations, 1);
+    frames     = MAX(frames, 1);
+
+    printf("{\n  \"libwebp\": \"%d.%d.%d\",\n  \"processors\": %d,\n"
+           "  \"iterations\": %d,\n  \"results\": [",
+           (WebPGetEncoderVersion() >> 16) & 0xff,
+           (WebPGetEncoderVersion() >> 8) & 0xff,
+           WebPGetEncoderVersion() & 0xff,
+           g_get_num_processors(),
+           iterations);
+
+    rand = g_rand_new_with_seed(1);
+
+    /* Synthetic corpus */
+    image = image_new("photo", 1920, 1080, 3);
+    fill_photo(image, rand, 0);
+    bench_configs(image);
+    image_free(image);
+
+    image = image_new("drawing", 1920, 1080, 3);
+    fill_drawing(image, rand);
+    bench_configs(image);
+    image_free(image);
+
+    image = image_new("alpha", 1920, 1080, 4);
+    fill_photo(image, rand, 0);
+    bench_configs(image);
+    image_free(image);
+
+    if (large) {
+        image = image_new("photo", 7680, 4320, 3);
+        fill_photo(image, rand, 0);
+        bench_configs(image);
+        image_free(image);
+
+        image = image_new("alpha", 7680, 4320, 4);
+        fill_photo(image, rand, 0);
+        bench_configs(image);
+        image_free(image);
+    }
+
+    g_rand_free(rand);
+
+#ifdef WEBP_0_5
+    bench_animation(640, 360);
+#endif
+
+    /* On-disk corpus */
+    for (i = 1; i < argc; ++i) {
+        image = image_from_file(argv[i]);
+        if (!image) {
+            g_printerr("Unable to load '%s'\n", argv[i]);
+            continue;
+        }
+
+        bench_configs(image);
+        image_free(image);
+    }
+
+    printf("\n  ]\n}\n");
+
+    return 0;
+}
@@ -0,0 +1,340 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <webp/decode.h>
+
+#include "webp-cache.h"
+
+/* Environment variable holding the size of the encode cache in MiB - the
+ * cache is off unless it is set, since a cached export is encoded to memory
+ * before anything is written instead of being streamed to disk */
+#define CACHE_SIZE_VARIABLE "GIMP_WEBP_CACHE_SIZE"
+#define CACHE_DEFAULT_SIZE  0
+
+/* Each entry is the bitstream of one export, named after its key */
+#define CACHE_DIRECTORY     "gimp-webp"
+#define CACHE_SUFFIX        ".webp"
+
+/* Constants from xxHash64 */
+#define PRIME64_1 G_GUINT64_CONSTANT(0x9E3779B185EBCA87)
+#define PRIME64_2 G_GUINT64_CONSTANT(0xC2B2AE3D27D4EB4F)
+#define PRIME64_3 G_GUINT64_CONSTANT(0x165667B19E3779F9)
+#define PRIME64_4 G_GUINT64_CONSTANT(0x85EBCA77C2B2AE63)
+#define PRIME64_5 G_GUINT64_CONSTANT(0x27D4EB2F165667C5)
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+typedef struct {
+    gchar  *path;
+    gint64  size;
+    gint64  mtime;
+} WebPCacheEntry;
+
+/* Retrieve the cache size in bytes */
+gint64 cache_size_limit(void)
+{
+    const gchar *value = g_getenv(CACHE_SIZE_VARIABLE);
+
+    return (gint64)(value ? MAX(atoi(value), 0) : CACHE_DEFAULT_SIZE) *
+           1024 * 1024;
+}
+
+/* Determine whether exports should be looked up in and added to the cache */
+gboolean cache_enabled(void)
+{
+    return cache_size_limit() > 0;
+}
+
+guint64 cache_read64(const guchar *p)
+{
+    guint64 v;
+
+    memcpy(&v, p, sizeof(v));
+    return GUINT64_FROM_LE(v);
+}
+
+guint64 cache_round(guint64 acc,
+                    guint64 input)
+{
+    acc += input * PRIME64_2;
+    acc  = ROTL64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+/* Hash a block of memory - this is xxHash64, which runs close to memory
+ * speed, so hashing the pixels costs far less than encoding them */
+guint64 cache_hash(const void *data,
+                   gsize       size,
+                   guint64     seed)
+{
+    const guchar *p   = data;
+    const guchar *end = p + size;
+    guint64       acc;
+
+    if (size >= 32) {
+        guint64 v1 = seed + PRIME64_1 + PRIME64_2;
+        guint64 v2 = seed + PRIME64_2;
+        guint64 v3 = seed;
+        guint64 v4 = seed - PRIME64_1;
+
+        for (; p + 32 <= end; p += 32) {
+            v1 = cache_round(v1, cache_read64(p));
+            v2 = cache_round(v2, cache_read64(p + 8));
+            v3 = cache_round(v3, cache_read64(p + 16));
+            v4 = cache_round(v4, cache_read64(p + 24));
+        }
+
+        acc = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+        acc = (acc ^ cache_round(0, v1)) * PRIME64_1 + PRIME64_4;
+        acc = (acc ^ cache_round(0, v2)) * PRIME64_1 + PRIME64_4;
+        acc = (acc ^ cache_round(0, v3)) * PRIME64_1 + PRIME64_4;
+        acc = (acc ^ cache_round(0, v4)) * PRIME64_1 + PRIME64_4;
+    } else {
+        acc = seed + PRIME64_5;
+    }
+
+    acc += size;
+
+    for (; p + 8 <= end; p += 8) {
+        acc ^= cache_round(0, cache_read64(p));
+        acc  = ROTL64(acc, 27) * PRIME64_1 + PRIME64_4;
+    }
+
+    if (p + 4 <= end) {
+        guint32 v;
+
+        memcpy(&v, p, sizeof(v));
+        acc ^= (guint64)GUINT32_FROM_LE(v) * PRIME64_1;
+        acc  = ROTL64(acc, 23) * PRIME64_2 + PRIME64_3;
+        p   += 4;
+    }
+
+    for (; p < end; ++p) {
+        acc ^= *p * PRIME64_5;
+        acc  = ROTL64(acc, 11) * PRIME64_1;
+    }
+
+    acc ^= acc >> 33;
+    acc *= PRIME64_2;
+    acc ^= acc >> 29;
+    acc *= PRIME64_3;
+    acc ^= acc >> 32;
+
+    return acc;
+}
+
+/* Build the key for an export from the encoder version, the resolved
+ * encoder settings (after the "auto" preset and the time budget have been
+ * applied), the options that change how they are used and the pixels of
+ * the picture */
+gchar *cache_key(const WebPPicture    *picture,
+                 const WebPConfig     *config,
+                 const WebPSaveParams *params)
+{
+    gchar   *description;
+    guint64  hash;
+    gint     y;
+
+    description = g_strdup_printf("%x %d %d %d %d %d %d %d %d %d %d %d %d %d "
+                                  "%d %d %d %d %d %d %d %d %dx%d",
+                                  WebPGetEncoderVersion(),
+                                  config->lossless,
+                                  (gint)(config->quality * 1000),
+                                  config->method,
+                                  config->image_hint,
+                                  config->target_size,
+                                  (gint)(config->target_PSNR * 1000),
+                                  config->segments,
+                                  config->sns_strength,
+                                  config->filter_strength,
+                                  config->filter_sharpness,
+                                  config->filter_type,
+                                  config->autofilter,
+                                  config->alpha_compression,
+                                  config->alpha_filtering,
+                                  config->alpha_quality,
+                                  config->pass,
+                                  config->preprocessing,
+                                  config->partitions,
+                                  config->partition_limit,
+                                  params->trials,
+                                  params->time_budget,
+                                  picture->width,
+                                  picture->height);
+
+    hash = cache_hash(description, strlen(description), 0);
+    g_free(description);
+
+    /* The picture has just been imported, so its pixels are ARGB words */
+    for (y = 0; y < picture->height; ++y) {
+        hash = cache_hash(picture->argb + (gsize)y * picture->argb_stride,
+                          (gsize)picture->width * sizeof(uint32_t),
+                          hash);
+    }
+
+    return g_strdup_printf("%016" G_GINT64_MODIFIER "x", hash);
+}
+
+gchar *cache_directory(void)
+{
+    return g_build_filename(g_get_user_cache_dir(), CACHE_DIRECTORY, NULL);
+}
+
+gchar *cache_path(const gchar *key)
+{
+    gchar *directory = cache_directory();
+    gchar *name      = g_strconcat(key, CACHE_SUFFIX, NULL);
+    gchar *path      = g_build_filename(directory, name, NULL);
+
+    g_free(directory);
+    g_free(name);
+
+    return path;
+}
+
+/* Retrieve the bitstream stored for a key - the entry is checked against
+ * the picture's dimensions and marked as recently used */
+gboolean cache_lookup(const gchar *key,
+                      gint         width,
+                      gint         height,
+                      gchar      **data,
+                      gsize       *size)
+{
+    gchar    *path   = cache_path(key);
+    gboolean  status = FALSE;
+    int       entry_width;
+    int       entry_height;
+
+    do {
+        if (!g_file_get_contents(path, data, size, NULL)) {
+            break;
+        }
+
+        if (!WebPGetInfo((const uint8_t*)*data, *size,
+                         &entry_width, &entry_height) ||
+                entry_width != width || entry_height != height) {
+            g_free(*data);
+            g_remove(path);
+            break;
+        }
+
+        /* Eviction removes the entries with the oldest modification time */
+        g_utime(path, NULL);
+
+        status = TRUE;
+
+    } while(0);
+
+    g_free(path);
+
+    return status;
+}
+
+gint cache_entry_compare(gconstpointer a,
+                         gconstpointer b)
+{
+    const WebPCacheEntry *entry_a = a;
+    const WebPCacheEntry *entry_b = b;
+
+    return entry_a->mtime < entry_b->mtime ? -1 :
+           entry_a->mtime > entry_b->mtime ? 1 : 0;
+}
+
+/* Remove the least recently used entries until the cache fits its size */
+void cache_evict(const gchar *directory,
+                 gint64       limit)
+{
+    GDir           *dir;
+    GArray         *entries;
+    const gchar    *name;
+    gint64          total = 0;
+    guint           i;
+
+    dir = g_dir_open(directory, 0, NULL);
+    if (!dir) {
+        return;
+    }
+
+    entries = g_array_new(FALSE, FALSE, sizeof(WebPCacheEntry));
+
+    while ((name = g_dir_read_name(dir))) {
+        WebPCacheEntry entry;
+        GStatBuf       buf;
+
+        if (!g_str_has_suffix(name, CACHE_SUFFIX)) {
+            continue;
+        }
+
+        entry.path = g_build_filename(directory, name, NULL);
+
+        if (g_stat(entry.path, &buf) != 0) {
+            g_free(entry.path);
+            continue;
+        }
+
+        entry.size  = buf.st_size;
+        entry.mtime = buf.st_mtime;
+        total      += entry.size;
+
+        g_array_append_val(entries, entry);
+    }
+
+    g_dir_close(dir);
+
+    if (total > limit) {
+        g_array_sort(entries, cache_entry_compare);
+
+        for (i = 0; i < entries->len && total > limit; ++i) {
+            WebPCacheEntry *entry = &g_array_index(entries, WebPCacheEntry, i);
+
+            if (g_remove(entry->path) == 0) {
+                total -= entry->size;
+            }
+        }
+    }
+
+    for (i = 0; i < entries->len; ++i) {
+        g_free(g_array_index(entries, WebPCacheEntry, i).path);
+    }
+
+    g_array_free(entries, TRUE);
+}
+
+/* Add a bitstream to the cache - failures are not errors, the export has
+ * already succeeded and will simply be encoded again next time */
+void cache_store(const gchar   *key,
+                 const uint8_t *data,
+                 gsize          size)
+{
+    gint64  limit     = cache_size_limit();
+    gchar  *directory = cache_directory();
+    gchar  *path      = cache_path(key);
+
+    /* Entries that would take up the whole cache are not worth keeping */
+    if (size <= limit && g_mkdir_with_parents(directory, 0700) == 0 &&
+            g_file_set_contents(path, (const gchar*)data, size, NULL)) {
+        cache_evict(directory, limit);
+    }
+
+    g_free(directory);
+    g_free(path);
+}
@@ -0,0 +1,47 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WEBP_CACHE_H__
+#define __WEBP_CACHE_H__
+
+#include <glib.h>
+#include <webp/encode.h>
+
+#include "webp-codec.h"
+
+gboolean cache_enabled(void);
+
+guint64 cache_hash(const void *data,
+                   gsize       size,
+                   guint64     seed);
+
+gchar *cache_key(const WebPPicture    *picture,
+                 const WebPConfig     *config,
+                 const WebPSaveParams *params);
+
+gboolean cache_lookup(const gchar *key,
+                      gint         width,
+                      gint         height,
+                      gchar      **data,
+                      gsize       *size);
+
+void cache_store(const gchar   *key,
+                 const uint8_t *data,
+                 gsize          size);
+
+#endif /* __WEBP_CACHE_H__ */
@@ -0,0 +1,1210 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <webp/decode.h>
+#include <webp/encode.h>
+#include <webp/mux.h>
+
+#include "webp-analyze.h"
+#include "webp-cache.h"
+#include "webp-codec.h"
+#include "webp-convert.h"
+
+/* Number of bytes handed to the incremental decoder at a time */
+#define DECODE_CHUNK_SIZE (64 * 1024)
+
+/* Abort encoding once the deadline attached to the picture (if any) has
+ * passed */
+int webp_deadline_progress(int                percent,
+                           const WebPPicture *picture)
+{
+    const gint64 *deadline = (const gint64*)picture->user_data;
+
+    return !(deadline && *deadline && g_get_monotonic_time() > *deadline);
+}
+
+/* Maximum number of passes used when searching for a target size or PSNR */
+#define TARGET_PASSES 6
+
+/* Approximate single-threaded encoding cost of each method, in nanoseconds
+ * per pixel - used for fitting the method to a time budget */
+const gdouble lossy_cost_per_pixel[]    = { 25, 35, 50, 70, 100, 170, 250 };
+const gdouble lossless_cost_per_pixel[] = { 50, 120, 250, 400, 600, 1000, 2000 };
+
+/* Name of the preset chosen from the content of each image */
+#define AUTO_PRESET "auto"
+
+/* Determine whether the settings are picked from the image's content */
+gboolean webp_preset_is_auto(const gchar *name)
+{
+    return name && !strcmp(name, AUTO_PRESET);
+}
+
+/* Determine which WebP preset to use given its name */
+WebPPreset webp_preset_by_name(gchar *name)
+{
+    if (!strcmp(name, "picture")) {
+        return WEBP_PRESET_PICTURE;
+    } else if (!strcmp(name, "photo")) {
+        return WEBP_PRESET_PHOTO;
+    } else if (!strcmp(name, "drawing")) {
+        return WEBP_PRESET_DRAWING;
+    } else if (!strcmp(name, "icon")) {
+        return WEBP_PRESET_ICON;
+    } else if (!strcmp(name, "text")) {
+        return WEBP_PRESET_TEXT;
+    } else {
+        return WEBP_PRESET_DEFAULT;
+    }
+}
+
+/* Convert error into a human-readable message */
+const gchar *webp_error_string(WebPEncodingError error_code)
+{
+    switch(error_code) {
+    case VP8_ENC_ERROR_OUT_OF_MEMORY:
+        return "out of memory";
+    case VP8_ENC_ERROR_BITSTREAM_OUT_OF_MEMORY:
+        return "not enough memory to flush bits";
+    case VP8_ENC_ERROR_NULL_PARAMETER:
+        return "NULL parameter";
+    case VP8_ENC_ERROR_INVALID_CONFIGURATION:
+        return "invalid configuration";
+    case VP8_ENC_ERROR_BAD_DIMENSION:
+        return "bad image dimensions";
+    case VP8_ENC_ERROR_PARTITION0_OVERFLOW:
+        return "partition is bigger than 512K";
+    case VP8_ENC_ERROR_PARTITION_OVERFLOW:
+        return "partition is bigger than 16M";
+    case VP8_ENC_ERROR_BAD_WRITE:
+        return "unable to flush bytes";
+    case VP8_ENC_ERROR_FILE_TOO_BIG:
+        return "file is larger than 4GiB";
+    case VP8_ENC_ERROR_USER_ABORT:
+        return "user aborted encoding";
+    case VP8_ENC_ERROR_LAST:
+        return "list terminator";
+    default:
+        return "unknown error";
+    }
+}
+
+/* Initialize the WebP configuration with a preset and fill in the
+ * remaining values from the save parameters */
+void webp_config_from_params(WebPConfig     *config,
+                             WebPSaveParams *params)
+{
+    WebPConfigPreset(config,
+                     webp_preset_by_name(params->preset),
+                     params->quality);
+
+    config->lossless      = params->lossless;
+    config->method        = 6;  /* better quality */
+
+    /* The "auto" preset starts out lossless, the mode that needs the most
+     * memory, so that estimates made before the pixels have been analyzed
+     * stay on the safe side */
+    if (webp_preset_is_auto(params->preset)) {
+        config->lossless = 1;
+    }
+    config->alpha_quality = params->alpha_quality;
+    config->thread_level  = params->threads ? 1 : 0;  /* alpha and analysis */
+
+    /* Let the encoder search for the quality that reaches the target size
+     * or PSNR - the analysis is done once and each pass refines the
+     * quality bounds from the statistics of the previous one */
+    if (params->target_size > 0 || params->target_psnr > 0) {
+        config->target_size = params->target_size;
+        config->target_PSNR = params->target_psnr;
+        config->pass        = TARGET_PASSES;
+    }
+}
+
+/* Pick the most thorough method expected to finish within the budget */
+void webp_config_fit_budget(WebPConfig *config,
+                            gint        pixels,
+                            gboolean    alpha,
+                            gint        budget)
+{
+    const gdouble *cost;
+    gdouble        factor = 1.0;
+
+    if (config->lossless) {
+        /* Higher lossless "quality" means more effort */
+        cost    = lossless_cost_per_pixel;
+        factor *= 0.5 + config->quality / 100.0;
+    } else {
+        cost    = lossy_cost_per_pixel;
+
+        /* The alpha plane is compressed separately */
+        if (alpha) {
+            factor *= config->thread_level ? 1.1 : 1.3;
+        }
+    }
+
+    for (config->method = 6; config->method > 0; --config->method) {
+        if (cost[config->method] * factor * pixels <= budget * 1e6) {
+            break;
+        }
+    }
+}
+
+/* Environment variable holding the default memory budget in MiB */
+#define MEMORY_BUDGET_VARIABLE "GIMP_WEBP_MEMORY_BUDGET"
+
+/* Approximate peak memory used while encoding, in bytes per pixel - this
+ * covers the ARGB picture, the encoder's working buffers and its output */
+#define LOSSY_BYTES_PER_PIXEL    12
+#define LOSSLESS_BYTES_PER_PIXEL 24
+#define ALPHA_BYTES_PER_PIXEL    6   /* separately compressed alpha plane */
+
+/* Retrieve the memory budget used when none is given (MiB, 0 for none) */
+gint webp_default_memory_budget(void)
+{
+    const gchar *value = g_getenv(MEMORY_BUDGET_VARIABLE);
+
+    return value ? MAX(atoi(value), 0) : 0;
+}
+
+/* Convert a memory budget to bytes - there is no limit without one */
+gint64 webp_memory_budget_bytes(gint budget)
+{
+    return budget > 0 ? (gint64)budget * 1024 * 1024 : G_MAXINT64;
+}
+
+/* Estimate the peak memory needed to encode a single picture */
+gint64 webp_encode_memory(const WebPConfig *config,
+                          gint              width,
+                          gint              height,
+                          gboolean          alpha)
+{
+    gint64 per_pixel = config->lossless ? LOSSLESS_BYTES_PER_PIXEL :
+                                          LOSSY_BYTES_PER_PIXEL;
+
+    if (alpha && !config->lossless) {
+        per_pixel += ALPHA_BYTES_PER_PIXEL;
+    }
+
+    return (gint64)width * height * per_pixel;
+}
+
+/* Replace the settings of the "auto" preset with the preset and mode that
+ * suit the picture's content, keeping the caller's thread level - returns
+ * FALSE, leaving the settings alone, for any other preset */
+gboolean webp_config_auto(WebPConfig           *config,
+                          const WebPPicture    *picture,
+                          const WebPSaveParams *params)
+{
+    WebPSaveParams auto_params  = *params;
+    WebPAnalysis   analysis;
+    int            thread_level = config->thread_level;
+
+    if (!webp_preset_is_auto(params->preset)) {
+        return FALSE;
+    }
+
+    analyze_picture(picture, &analysis);
+    auto_params.preset = (gchar*)analysis_preset(&analysis,
+                                                 picture->width,
+                                                 picture->height,
+                                                 &auto_params.lossless);
+
+    webp_config_from_params(config, &auto_params);
+    config->thread_level = thread_level;
+
+    return TRUE;
+}
+
+/* Effort of the fast and thorough lossless trials (method and quality) */
+#define TRIAL_FAST_METHOD      2
+#define TRIAL_FAST_QUALITY     25
+#define TRIAL_THOROUGH_METHOD  6
+#define TRIAL_THOROUGH_QUALITY 100
+
+/* Derive the configurations tried by encode_smallest() - lossy at the
+ * chosen quality, then lossless with little and with maximum effort */
+void webp_trial_configs(const WebPConfig *config,
+                        WebPConfig        trials[TRIAL_COUNT])
+{
+    gint i;
+
+    for (i = 0; i < TRIAL_COUNT; ++i) {
+        trials[i] = *config;
+    }
+
+    trials[0].lossless = 0;
+
+    trials[1].lossless = 1;
+    trials[1].method   = TRIAL_FAST_METHOD;
+    trials[1].quality  = TRIAL_FAST_QUALITY;
+
+    trials[2].lossless = 1;
+    trials[2].method   = TRIAL_THOROUGH_METHOD;
+    trials[2].quality  = TRIAL_THOROUGH_QUALITY;
+}
+
+/* Estimate the peak memory needed by encode_smallest(), which runs every
+ * trial at once on its own copy of the picture */
+gint64 webp_trials_memory(const WebPConfig *config,
+                          gint              width,
+                          gint              height,
+                          gboolean          alpha)
+{
+    WebPConfig trials[TRIAL_COUNT];
+    gint64     total = 0;
+    gint       i;
+
+    webp_trial_configs(config, trials);
+
+    for (i = 0; i < TRIAL_COUNT; ++i) {
+        total += webp_encode_memory(&trials[i], width, height, alpha);
+    }
+
+    return total;
+}
+
+/* Pack rows of RGB or RGBA pixels into the picture's ARGB plane - this is
+ * the same conversion WebPPictureImportRGB(A) performs - and return TRUE if
+ * every pixel is fully opaque */
+gboolean import_rows(WebPPicture  *picture,
+                     const guchar *rows,
+                     gint          y,
+                     gint          nrows,
+                     gint          bpp)
+{
+    gboolean opaque = TRUE;
+    gint     i;
+
+    for (i = 0; i < nrows; ++i) {
+        const guchar *src = rows + i * picture->width * bpp;
+        uint32_t     *dst = picture->argb + (y + i) * picture->argb_stride;
+
+        if (bpp == 4) {
+            opaque &= convert_rgba_to_argb(src, dst, picture->width);
+        } else {
+            convert_rgb_to_argb(src, dst, picture->width);
+        }
+    }
+
+    return opaque;
+}
+
+/* Allocate the picture and fill it from packed rows of RGB or RGBA pixels,
+ * one strip at a time so that the picture itself is the only full-size
+ * copy - opaque is set to FALSE if any pixel has transparency */
+gboolean read_strips(WebPPicture   *picture,
+                     gint           width,
+                     gint           height,
+                     gint           bpp,
+                     gint           strip_height,
+                     WebPStripFunc  func,
+                     gpointer       user_data,
+                     gboolean      *opaque,
+                     WebPStats     *stats,
+                     GError       **error)
+{
+    gboolean  all_opaque = TRUE;
+    gboolean  ok         = TRUE;
+    gint64    start;
+    guchar   *buffer;
+    gint      y;
+
+    picture->use_argb = 1;
+    picture->width    = width;
+    picture->height   = height;
+
+    strip_height = CLAMP(strip_height, 1, MAX(height, 1));
+
+    /* Allocate the picture and a buffer for a single strip */
+    buffer = (guchar *)g_try_malloc((gsize)bpp * width * strip_height);
+    if (!buffer || !WebPPictureAlloc(picture)) {
+        g_free(buffer);
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    0,
+                    "Unable to allocate buffer for layer");
+        return FALSE;
+    }
+
+    for (y = 0; ok && y < height; y += strip_height) {
+        gint nrows = MIN(strip_height, height - y);
+
+        start = g_get_monotonic_time();
+        ok    = func(buffer, y, nrows, user_data);
+        stats_add_time(stats, STATS_READ, start);
+
+        if (ok) {
+            start = g_get_monotonic_time();
+            all_opaque &= import_rows(picture, buffer, y, nrows, bpp);
+            stats_add_time(stats, STATS_IMPORT, start);
+        } else {
+            g_set_error(error,
+                        G_FILE_ERROR,
+                        0,
+                        "Unable to read the pixels of the layer");
+        }
+    }
+
+    if (opaque) {
+        *opaque = all_opaque;
+    }
+
+    g_free(buffer);
+
+    return ok;
+}
+
+/* Encode a picture, giving up on the chosen method once the budget runs out
+ * and starting again with the fastest one - output is buffered so that
+ * nothing from an abandoned attempt reaches the writer */
+gboolean encode_with_budget(WebPConfig  *config,
+                            WebPPicture *picture,
+                            gint         budget)
+{
+    WebPWriterFunction writer     = picture->writer;
+    void              *custom_ptr = picture->custom_ptr;
+    WebPMemoryWriter   memory;
+    gint64             deadline;
+    gboolean           ok;
+
+    deadline = g_get_monotonic_time() + (gint64)budget * 1000;
+
+    WebPMemoryWriterInit(&memory);
+    picture->writer     = WebPMemoryWrite;
+    picture->custom_ptr = &memory;
+    picture->user_data  = &deadline;
+
+    ok = WebPEncode(config, picture);
+
+    if (!ok && picture->error_code == VP8_ENC_ERROR_USER_ABORT &&
+            config->method > 0 && g_get_monotonic_time() > deadline) {
+        deadline = 0;
+        config->method = 0;
+
+        WebPMemoryWriterClear(&memory);
+        WebPMemoryWriterInit(&memory);
+        picture->error_code = VP8_ENC_OK;
+
+        ok = WebPEncode(config, picture);
+    }
+
+    /* Hand the finished bitstream to the real writer */
+    picture->writer     = writer;
+    picture->custom_ptr = custom_ptr;
+    picture->user_data  = NULL;
+
+    if (ok && !writer(memory.mem, memory.size, picture)) {
+        picture->error_code = VP8_ENC_ERROR_BAD_WRITE;
+        ok = FALSE;
+    }
+
+    WebPMemoryWriterClear(&memory);
+
+    return ok;
+}
+
+/* Trials of a call to encode_smallest() that have not finished yet */
+typedef struct {
+    GMutex mutex;
+    GCond  cond;
+    gint   pending;
+} WebPTrialSync;
+
+/* A single trial of encode_smallest() */
+typedef struct {
+    WebPMemoryWriter   memory;
+    WebPConfig         config;
+    WebPPicture        picture;
+    WebPAuxStats       aux_stats;
+    WebPTrialSync     *sync;
+    gint64             deadline;  /* monotonic time, or 0 for none */
+    gboolean           ok;
+    gboolean           cancelled; /* stopped by the hook of the parent */
+    const WebPPicture *parent;    /* picture whose progress hook is chained */
+} WebPTrial;
+
+/* Threads shared by every call to encode_smallest() */
+GThreadPool *trial_pool = NULL;
+
+/* Abort a trial once its deadline has passed, and otherwise hand the
+ * progress on to the hook of the picture being encoded, which may cancel
+ * the trial too */
+int trial_progress(int                percent,
+                   const WebPPicture *picture)
+{
+    WebPTrial *trial = (WebPTrial*)((guchar*)picture->user_data -
+                                    G_STRUCT_OFFSET(WebPTrial, deadline));
+
+    if (!webp_deadline_progress(percent, picture)) {
+        return 0;
+    }
+
+    if (trial->parent->progress_hook &&
+            !trial->parent->progress_hook(percent, trial->parent)) {
+        trial->cancelled = TRUE;
+        return 0;
+    }
+
+    return 1;
+}
+
+void trial_encode(gpointer data,
+                  gpointer user_data)
+{
+    WebPTrial *trial = (WebPTrial*)data;
+
+    trial->ok = WebPEncode(&trial->config, &trial->picture);
+
+    /* Start again with the fastest method once the deadline has passed,
+     * as encode_with_budget() does */
+    if (!trial->ok &&
+            trial->picture.error_code == VP8_ENC_ERROR_USER_ABORT &&
+            trial->config.method > 0 &&
+            trial->deadline > 0 &&
+            g_get_monotonic_time() > trial->deadline) {
+        trial->deadline      = 0;
+        trial->config.method = 0;
+
+        WebPMemoryWriterClear(&trial->memory);
+        WebPMemoryWriterInit(&trial->memory);
+        trial->picture.error_code = VP8_ENC_OK;
+
+        trial->ok = WebPEncode(&trial->config, &trial->picture);
+    }
+
+    /* The copy of the pixels is no longer needed */
+    WebPPictureFree(&trial->picture);
+
+    g_mutex_lock(&trial->sync->mutex);
+    --trial->sync->pending;
+    g_cond_signal(&trial->sync->cond);
+    g_mutex_unlock(&trial->sync->mutex);
+}
+
+/* Create the pool of trial threads the first time it is needed - there is
+ * a thread for each trial, or one per processor when several images are
+ * encoded at once */
+GThreadPool *webp_trial_pool(void)
+{
+    static gsize initialized = 0;
+
+    if (g_once_init_enter(&initialized)) {
+        trial_pool = g_thread_pool_new(trial_encode,
+                                       NULL,
+                                       MAX(g_get_num_processors(), TRIAL_COUNT),
+                                       FALSE,
+                                       NULL);
+        g_once_init_leave(&initialized, 1);
+    }
+
+    return trial_pool;
+}
+
+/* Encode a picture with each of the trial configurations at once and hand
+ * only the smallest result to the picture's writer - the time budget, if
+ * any, applies to each trial separately, and a trial still running when
+ * it runs out falls back to the fastest method */
+gboolean encode_smallest(const WebPConfig *config,
+                         WebPPicture      *picture,
+                         gint              time_budget)
+{
+    WebPConfig     configs[TRIAL_COUNT];
+    WebPTrial      trials[TRIAL_COUNT];
+    WebPTrialSync  sync;
+    GThreadPool   *pool     = webp_trial_pool();
+    WebPTrial     *best     = NULL;
+    gint           started  = 0;
+    gint64         deadline = 0;
+    gint           i;
+
+    webp_trial_configs(config, configs);
+
+    if (time_budget > 0) {
+        deadline = g_get_monotonic_time() + (gint64)time_budget * 1000;
+    }
+
+    g_mutex_init(&sync.mutex);
+    g_cond_init(&sync.cond);
+    sync.pending = 0;
+
+    for (i = 0; i < TRIAL_COUNT; ++i) {
+        WebPMemoryWriterInit(&trials[i].memory);
+    }
+
+    for (i = 0; i < TRIAL_COUNT; ++i) {
+        WebPTrial *trial = &trials[i];
+
+        trial->config    = configs[i];
+        trial->sync      = &sync;
+        trial->ok        = FALSE;
+        trial->cancelled = FALSE;
+        trial->parent    = picture;
+
+        if (time_budget > 0) {
+            webp_config_fit_budget(&trial->config,
+                                   picture->width * picture->height,
+                                   WebPPictureHasTransparency(picture),
+                                   time_budget);
+        }
+
+        /* There is nothing faster to fall back to from method 0 */
+        trial->deadline = trial->config.method > 0 ? deadline : 0;
+
+        /* Each trial converts its own copy of the pixels */
+        if (!WebPPictureCopy(picture, &trial->picture)) {
+            picture->error_code = VP8_ENC_ERROR_OUT_OF_MEMORY;
+            break;
+        }
+
+        trial->picture.writer        = WebPMemoryWrite;
+        trial->picture.custom_ptr    = &trial->memory;
+        trial->picture.progress_hook = trial_progress;
+        trial->picture.user_data     = &trial->deadline;
+        trial->picture.stats         = picture->stats ? &trial->aux_stats : NULL;
+
+        g_mutex_lock(&sync.mutex);
+        ++sync.pending;
+        g_mutex_unlock(&sync.mutex);
+
+        g_thread_pool_push(pool, trial, NULL);
+        ++started;
+    }
+
+    /* Wait for every trial that was started */
+    g_mutex_lock(&sync.mutex);
+    while (sync.pending > 0) {
+        g_cond_wait(&sync.cond, &sync.mutex);
+    }
+    g_mutex_unlock(&sync.mutex);
+
+    /* Keep nothing if the caller cancelled the encode */
+    for (i = 0; i < started; ++i) {
+        if (trials[i].cancelled) {
+            picture->error_code = VP8_ENC_ERROR_USER_ABORT;
+            started = 0;
+        }
+    }
+
+    for (i = 0; i < started; ++i) {
+        if (started == TRIAL_COUNT && trials[i].ok &&
+                (!best || trials[i].memory.size < best->memory.size)) {
+            best = &trials[i];
+        }
+    }
+
+    if (best) {
+        if (picture->stats) {
+            *picture->stats = best->aux_stats;
+        }
+        if (!picture->writer(best->memory.mem, best->memory.size, picture)) {
+            picture->error_code = VP8_ENC_ERROR_BAD_WRITE;
+            best = NULL;
+        }
+    } else if (started > 0 && picture->error_code == VP8_ENC_OK) {
+        picture->error_code = trials[0].picture.error_code;
+    }
+
+    for (i = 0; i < TRIAL_COUNT; ++i) {
+        WebPMemoryWriterClear(&trials[i].memory);
+    }
+
+    g_cond_clear(&sync.cond);
+    g_mutex_clear(&sync.mutex);
+
+    return best != NULL;
+}
+
+/* Encode a picture whose pixels have been read, as an export does: pick
+ * the settings for the "auto" preset and the time budget, reuse the output
+ * of an earlier export from the cache or add this one to it, and keep the
+ * smallest trial if asked to - the output goes to the picture's writer */
+gboolean encode_picture(const WebPConfig     *config,
+                        WebPPicture          *picture,
+                        const WebPSaveParams *params,
+                        gboolean              alpha,
+                        WebPStats            *stats,
+                        GError              **error)
+{
+    gboolean            status        = FALSE;
+    WebPConfig          encode_config = *config;
+    WebPWriterFunction  writer        = picture->writer;
+    void               *custom_ptr    = picture->custom_ptr;
+    WebPAuxStats        aux_stats;
+    WebPMemoryWriter    memory;
+    gchar              *key           = NULL;
+    gchar              *data;
+    gsize               size;
+    gint64              start;
+    int                 method;
+    gboolean            ok;
+
+    WebPMemoryWriterInit(&memory);
+    picture->stats = stats ? &aux_stats : NULL;
+
+    /* Pick the preset from the pixels for the "auto" preset */
+    webp_config_auto(&encode_config, picture, params);
+
+    /* Pick the most thorough settings that fit within the time budget */
+    if (params->time_budget > 0) {
+        webp_config_fit_budget(&encode_config,
+                               picture->width * picture->height,
+                               alpha,
+                               params->time_budget);
+    }
+
+    start  = g_get_monotonic_time();
+    method = encode_config.method;
+
+    do {
+        /* Reuse the bitstream of an earlier export of the same pixels with
+         * the same settings - otherwise encode to memory so that the
+         * result can be added to the cache */
+        if (cache_enabled()) {
+            key = cache_key(picture, &encode_config, params);
+
+            if (cache_lookup(key, picture->width, picture->height,
+                             &data, &size)) {
+                ok = writer((const uint8_t*)data, size, picture);
+                g_free(data);
+
+                if (!ok) {
+                    g_set_error(error,
+                                G_FILE_ERROR,
+                                VP8_ENC_ERROR_BAD_WRITE,
+                                "WebP error: '%s'",
+                                webp_error_string(VP8_ENC_ERROR_BAD_WRITE));
+                    break;
+                }
+
+                stats_add_time(stats, STATS_ENCODE, start);
+
+                status = TRUE;
+                break;
+            }
+
+            picture->writer     = WebPMemoryWrite;
+            picture->custom_ptr = &memory;
+        }
+
+        if (params->trials ?
+                !encode_smallest(&encode_config, picture, params->time_budget) :
+            params->time_budget > 0 ?
+                !encode_with_budget(&encode_config, picture, params->time_budget) :
+                !WebPEncode(&encode_config, picture)) {
+            g_set_error(error,
+                        G_FILE_ERROR,
+                        picture->error_code,
+                        "WebP error: '%s'",
+                        webp_error_string(picture->error_code));
+            break;
+        }
+
+        if (key) {
+            picture->writer     = writer;
+            picture->custom_ptr = custom_ptr;
+
+            if (!writer(memory.mem, memory.size, picture)) {
+                g_set_error(error,
+                            G_FILE_ERROR,
+                            VP8_ENC_ERROR_BAD_WRITE,
+                            "WebP error: '%s'",
+                            webp_error_string(VP8_ENC_ERROR_BAD_WRITE));
+                break;
+            }
+
+            /* Output of the fallback taken when the time budget ran out
+             * depends on timing, so it is not kept - neither are trials
+             * under a time budget, any of which may have fallen back */
+            if (encode_config.method == method &&
+                    !(params->trials && params->time_budget > 0)) {
+                cache_store(key, memory.mem, memory.size);
+            }
+        }
+
+        stats_add_time(stats, STATS_ENCODE, start);
+
+        if (picture->stats) {
+            stats_add_aux(stats, &aux_stats);
+        }
+
+        status = TRUE;
+
+    } while(0);
+
+    picture->writer     = writer;
+    picture->custom_ptr = custom_ptr;
+    picture->stats      = NULL;
+
+    WebPMemoryWriterClear(&memory);
+    g_free(key);
+
+    return status;
+}
+
+/* Encode a buffer of RGB or RGBA pixels into memory - this is what the
+ * plug-in does with a layer once its pixels have been read */
+gboolean encode_pixels(const WebPConfig     *config,
+                       const WebPSaveParams *params,
+                       const guchar         *pixels,
+                       gint                  width,
+                       gint                  height,
+                       gint                  bpp,
+                       WebPMemoryWriter     *memory,
+                       WebPStats            *stats,
+                       GError              **error)
+{
+    WebPPicture picture;
+    gboolean    ok;
+    gint64      start;
+
+    WebPPictureInit(&picture);
+    picture.use_argb      = 1;
+    picture.width         = width;
+    picture.height        = height;
+    picture.writer        = WebPMemoryWrite;
+    picture.custom_ptr    = memory;
+    picture.progress_hook = webp_deadline_progress;
+
+    if (!WebPPictureAlloc(&picture)) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    VP8_ENC_ERROR_OUT_OF_MEMORY,
+                    "WebP error: '%s'",
+                    webp_error_string(VP8_ENC_ERROR_OUT_OF_MEMORY));
+        return FALSE;
+    }
+
+    start = g_get_monotonic_time();
+    import_rows(&picture, pixels, 0, height, bpp);
+    stats_add_time(stats, STATS_IMPORT, start);
+
+    ok = encode_picture(config, &picture, params, bpp == 4, stats, error);
+
+    WebPPictureFree(&picture);
+
+    return ok;
+}
+
+/* Decode a bitstream in a single pass of the incremental decoder, handing
+ * each strip of rows to the callback as soon as it is complete.  The rows
+ * land in a surface the size of the whole image, which libwebp needs for
+ * its output and is held until the end - lossless bitstreams also need a
+ * full-size ARGB surface inside libwebp - so memory is not bounded by the
+ * strips, but the rows reach the callback while the rest is decoded */
+VP8StatusCode decode_incremental(const uint8_t *data,
+                                 size_t         data_size,
+                                 gboolean       alpha,
+                                 gint           width,
+                                 gint           height,
+                                 WebPRowsFunc   func,
+                                 gpointer       user_data)
+{
+    WebPIDecoder  *idec;
+    VP8StatusCode  vp8_status = VP8_STATUS_SUSPENDED;
+    uint8_t       *surface;
+    gint           stride     = width * (alpha ? 4 : 3);
+    size_t         available  = 0;
+    gint           rows_done  = 0;
+
+    /* libwebp 0.4 cannot allocate the surface itself */
+    surface = (uint8_t*)g_try_malloc((gsize)stride * height);
+    if (!surface) {
+        return VP8_STATUS_OUT_OF_MEMORY;
+    }
+
+    idec = WebPINewRGB(alpha ? MODE_RGBA : MODE_RGB,
+                       surface, (size_t)stride * height, stride);
+    if (!idec) {
+        g_free(surface);
+        return VP8_STATUS_OUT_OF_MEMORY;
+    }
+
+    /* Feed the decoder progressively larger views of the (unchanged) input
+     * and pass on the rows completed since the last call */
+    while (available < data_size && vp8_status == VP8_STATUS_SUSPENDED) {
+        int last_y;
+
+        available  = MIN(available + DECODE_CHUNK_SIZE, data_size);
+        vp8_status = WebPIUpdate(idec, data, available);
+
+        if (vp8_status != VP8_STATUS_OK && vp8_status != VP8_STATUS_SUSPENDED) {
+            break;
+        }
+
+        if (WebPIDecGetRGB(idec, &last_y, NULL, NULL, NULL) &&
+                last_y > rows_done) {
+            func(surface + (gsize)rows_done * stride, rows_done,
+                 last_y - rows_done, stride, user_data);
+            rows_done = last_y;
+        }
+    }
+
+    WebPIDelete(idec);
+    g_free(surface);
+
+    if (vp8_status == VP8_STATUS_OK && rows_done != height) {
+        vp8_status = VP8_STATUS_NOT_ENOUGH_DATA;
+    }
+
+    return vp8_status;
+}
+
+#ifdef WEBP_0_5
+/* Frames decoded ahead of the one being handed on, per worker thread */
+#define FRAMES_IN_FLIGHT_PER_THREAD 2
+
+/* A single animation frame handed to the decoding threads */
+typedef struct {
+    const uint8_t *data;
+    size_t         data_size;
+    gint           offsetx;
+    gint           offsety;
+    gboolean       alpha;
+    gint           width;
+    gint           height;
+    uint8_t       *rgba;
+    gint64         decode_time;
+    gboolean       done;
+} WebPDecodeJob;
+
+/* State shared between the main thread and the decoding threads */
+typedef struct {
+    GMutex mutex;
+    GCond  cond;
+} WebPDecodeSync;
+
+/* Decode a single frame on one of the worker threads */
+void decode_frame_job(gpointer data,
+                      gpointer user_data)
+{
+    WebPDecodeJob  *job  = (WebPDecodeJob*)data;
+    WebPDecodeSync *sync = (WebPDecodeSync*)user_data;
+    uint8_t        *rgba;
+    gint            width;
+    gint            height;
+    gint64          start = g_get_monotonic_time();
+
+    if (job->alpha) {
+        rgba = WebPDecodeRGBA(job->data, job->data_size, &width, &height);
+    } else {
+        rgba = WebPDecodeRGB(job->data, job->data_size, &width, &height);
+    }
+
+    /* Hand the result back to the main thread */
+    g_mutex_lock(&sync->mutex);
+    job->rgba        = rgba;
+    job->width       = width;
+    job->height      = height;
+    job->decode_time = g_get_monotonic_time() - start;
+    job->done        = TRUE;
+    g_cond_broadcast(&sync->cond);
+    g_mutex_unlock(&sync->mutex);
+}
+
+/* Decode the frames of an animation concurrently, handing each one to the
+ * callback on the calling thread in order as soon as it is available -
+ * decoding stops if the callback returns FALSE */
+gboolean decode_frames(WebPDemuxer   *demux,
+                       WebPFrameFunc  func,
+                       gpointer       user_data,
+                       WebPStats     *stats,
+                       GError       **error)
+{
+    gboolean        status    = TRUE;
+    gint            nframes;
+    gint            nthreads;
+    gint            window;
+    gint            next_push = 0;
+    gint            i;
+    WebPDecodeJob  *jobs;
+    WebPDecodeSync  sync;
+    GThreadPool    *pool;
+    WebPIterator    iter;
+
+    nframes = WebPDemuxGetI(demux, WEBP_FF_FRAME_COUNT);
+    if (nframes < 1) {
+        return TRUE;
+    }
+
+    /* Record where each frame lives within the file */
+    jobs = g_new0(WebPDecodeJob, nframes);
+    if (WebPDemuxGetFrame(demux, 1, &iter)) {
+        do {
+            WebPDecodeJob *job = &jobs[iter.frame_num - 1];
+
+            job->data      = iter.fragment.bytes;
+            job->data_size = iter.fragment.size;
+            job->offsetx   = iter.x_offset;
+            job->offsety   = iter.y_offset;
+            job->alpha     = iter.has_alpha;
+        } while (WebPDemuxNextFrame(&iter));
+
+        WebPDemuxReleaseIterator(&iter);
+    }
+
+    /* Size the pool to the machine and cap the number of decoded frames
+     * waiting to be handed on */
+    nthreads = MAX(g_get_num_processors(), 1);
+    window   = nthreads * FRAMES_IN_FLIGHT_PER_THREAD;
+
+    g_mutex_init(&sync.mutex);
+    g_cond_init(&sync.cond);
+
+    pool = g_thread_pool_new(decode_frame_job, &sync, nthreads, FALSE, NULL);
+
+    for (i = 0; i < nframes; ++i) {
+        WebPDecodeJob *job = &jobs[i];
+
+        /* Keep the workers busy up to the end of the window */
+        while (next_push < nframes && next_push < i + window) {
+            g_thread_pool_push(pool, &jobs[next_push++], NULL);
+        }
+
+        /* Wait for the next frame in order */
+        g_mutex_lock(&sync.mutex);
+        while (!job->done) {
+            g_cond_wait(&sync.cond, &sync.mutex);
+        }
+        g_mutex_unlock(&sync.mutex);
+
+        if (!job->rgba) {
+            g_set_error(error,
+                        G_FILE_ERROR,
+                        0,
+                        "Unable to decode frame %d",
+                        i + 1);
+            status = FALSE;
+            break;
+        }
+
+        if (stats) {
+            stats->time[STATS_DECODE] += job->decode_time;
+        }
+
+        if (!func(i, job->rgba, job->width, job->height, job->alpha,
+                  job->offsetx, job->offsety, user_data)) {
+            status = FALSE;
+            break;
+        }
+
+        free(job->rgba);
+        job->rgba = NULL;
+    }
+
+    /* Drop any frames that were not started and wait for the rest */
+    g_thread_pool_free(pool, TRUE, TRUE);
+
+    for (i = 0; i < nframes; ++i) {
+        free(jobs[i].rgba);
+    }
+
+    g_cond_clear(&sync.cond);
+    g_mutex_clear(&sync.mutex);
+    g_free(jobs);
+
+    return status;
+}
+
+/* Store a little-endian value of the given number of bytes */
+void put_le(uint8_t *dst,
+            guint32  value,
+            gint     nbytes)
+{
+    gint i;
+
+    for (i = 0; i < nbytes; ++i) {
+        dst[i] = (value >> (i * 8)) & 0xff;
+    }
+}
+
+/* Write the RIFF header along with the VP8X and ANIM chunks - the RIFF size
+ * and the alpha flag are filled in by anim_stream_end() */
+gboolean anim_stream_begin(WebPAnimStream  *stream,
+                           WebPAsyncWriter *outfile,
+                           gint             width,
+                           gint             height,
+                           gboolean         loop,
+                           GError         **error)
+{
+    uint8_t header[12 + 18 + 14] = {0};
+
+    stream->outfile = outfile;
+    stream->size    = sizeof(header) - 8;
+    stream->alpha   = FALSE;
+
+    memcpy(header, "RIFF", 4);
+    memcpy(header + 8, "WEBP", 4);
+
+    /* VP8X: feature flags and canvas size */
+    memcpy(header + 12, "VP8X", 4);
+    put_le(header + 16, 10, 4);
+    header[20] = ANIMATION_FLAG;
+    put_le(header + 24, width - 1, 3);
+    put_le(header + 27, height - 1, 3);
+
+    /* ANIM: background color and loop count */
+    memcpy(header + 30, "ANIM", 4);
+    put_le(header + 34, 6, 4);
+    put_le(header + 38, 0xffffffff, 4);
+    put_le(header + 42, loop ? 0 : 1, 2);
+
+    if (!async_writer_write(outfile, header, sizeof(header))) {
+        async_writer_set_error(outfile, error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Retrieve the size of a RIFF chunk, including its header and padding */
+guint64 riff_chunk_size(const uint8_t *chunk)
+{
+    guint64 size = 8 + (guint64)chunk[4] + ((guint64)chunk[5] << 8) +
+            ((guint64)chunk[6] << 16) + ((guint64)chunk[7] << 24);
+
+    return size + (size & 1);
+}
+
+/* Whether a chunk belongs in the frame data of an ANMF chunk */
+gboolean is_frame_chunk(const uint8_t *chunk)
+{
+    return !memcmp(chunk, "ALPH", 4) ||
+           !memcmp(chunk, "VP8 ", 4) ||
+           !memcmp(chunk, "VP8L", 4);
+}
+
+/* Wrap the image chunks of a complete WebP file in an ANMF chunk and write
+ * it out - VP8X and any metadata chunks of the frame are dropped.  Frames
+ * may come from layer parasites, so every chunk is checked to lie within
+ * the data */
+gboolean anim_stream_add_frame(WebPAnimStream *stream,
+                               const uint8_t  *data,
+                               size_t          data_size,
+                               gint            width,
+                               gint            height,
+                               gint            duration,
+                               gboolean        alpha,
+                               GError        **error)
+{
+    uint8_t        header[8 + 16] = {0};
+    const uint8_t *chunk;
+    const uint8_t *end      = data + data_size;
+    guint64        payload  = 0;
+    gboolean       image    = FALSE;
+
+    if (data_size < 12 || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WEBP", 4)) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    0,
+                    "Malformed WebP frame: missing RIFF header");
+        return FALSE;
+    }
+
+    /* Work out how much of the frame will be kept */
+    for (chunk = data + 12; chunk < end; ) {
+        guint64 chunk_size;
+
+        if (end - chunk < 8 ||
+                (chunk_size = riff_chunk_size(chunk)) > (guint64)(end - chunk)) {
+            g_set_error(error,
+                        G_FILE_ERROR,
+                        0,
+                        "Malformed WebP frame: chunk at offset %d is truncated",
+                        (gint)(chunk - data));
+            return FALSE;
+        }
+
+        if (!memcmp(chunk, "VP8 ", 4) || !memcmp(chunk, "VP8L", 4)) {
+            image = TRUE;
+        }
+        if (is_frame_chunk(chunk)) {
+            payload += chunk_size;
+        }
+        chunk += chunk_size;
+    }
+
+    if (!image) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    0,
+                    "Malformed WebP frame: no image data");
+        return FALSE;
+    }
+
+    /* The RIFF size is only 32 bits wide */
+    if ((guint64)stream->size + sizeof(header) + payload > G_MAXUINT32) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    0,
+                    "Animation is too large for a WebP file");
+        return FALSE;
+    }
+
+    memcpy(header, "ANMF", 4);
+    put_le(header + 4, (guint32)(16 + payload), 4);
+    put_le(header + 14, width - 1, 3);
+    put_le(header + 17, height - 1, 3);
+    put_le(header + 20, duration, 3);
+    header[23] = 0x02;  /* do not blend, do not dispose */
+
+    if (!async_writer_write(stream->outfile, header, sizeof(header))) {
+        async_writer_set_error(stream->outfile, error);
+        return FALSE;
+    }
+
+    /* Copy the ALPH and VP8/VP8L chunks as they are */
+    for (chunk = data + 12; chunk < end; ) {
+        gsize chunk_size = (gsize)riff_chunk_size(chunk);
+
+        if (is_frame_chunk(chunk) &&
+                !async_writer_write(stream->outfile, chunk, chunk_size)) {
+            async_writer_set_error(stream->outfile, error);
+            return FALSE;
+        }
+        chunk += chunk_size;
+    }
+
+    stream->size  += sizeof(header) + (guint32)payload;
+    stream->alpha |= alpha;
+
+    return TRUE;
+}
+
+/* Fill in the size of the RIFF container and flag transparency if any of
+ * the frames turned out to have some */
+gboolean anim_stream_end(WebPAnimStream *stream,
+                         GError        **error)
+{
+    uint8_t size[4];
+    uint8_t flags = ANIMATION_FLAG | ALPHA_FLAG;
+
+    put_le(size, stream->size, 4);
+
+    if ((stream->alpha &&
+            !async_writer_patch(stream->outfile, 20, &flags, 1)) ||
+            !async_writer_patch(stream->outfile, 4, size, sizeof(size))) {
+        async_writer_set_error(stream->outfile, error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+#endif
@@ -0,0 +1,209 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WEBP_CODEC_H__
+#define __WEBP_CODEC_H__
+
+#include <glib.h>
+#include <webp/decode.h>
+#include <webp/demux.h>
+#include <webp/encode.h>
+
+#include "config.h"
+#include "webp-stats.h"
+#include "webp-writer.h"
+
+#ifndef WEBP_0_5
+/* WebPMemoryWriterClear() was only added in libwebp 0.5 */
+#  include <stdlib.h>
+#  define WebPMemoryWriterClear(writer) free((writer)->mem)
+#endif
+
+typedef struct {
+    gchar   *preset;
+    gboolean lossless;
+    gfloat   quality;
+    gfloat   alpha_quality;
+    gboolean threads;
+    gint     time_budget;
+    gint     target_size;
+    gfloat   target_psnr;
+    gint     memory_budget;  /* MiB, 0 for no limit */
+    gboolean trials;         /* keep the smallest of several encodings */
+#ifdef WEBP_0_5
+    gboolean animation;
+    gboolean loop;
+    gboolean anim_parallel;
+#endif
+} WebPSaveParams;
+
+/* Number of configurations tried when keeping the smallest encoding */
+#define TRIAL_COUNT 3
+
+/* Receives strips of decoded rows, starting at row y */
+typedef void (*WebPRowsFunc)(const uint8_t *rows,
+                             gint           y,
+                             gint           nrows,
+                             gint           stride,
+                             gpointer       user_data);
+
+/* Fills a buffer with rows y to y + nrows of packed RGB or RGBA pixels */
+typedef gboolean (*WebPStripFunc)(guchar   *buffer,
+                                  gint      y,
+                                  gint      nrows,
+                                  gpointer  user_data);
+
+#ifdef WEBP_0_5
+/* Receives each decoded frame of an animation, in order */
+typedef gboolean (*WebPFrameFunc)(gint           index,
+                                  const uint8_t *rgba,
+                                  gint           width,
+                                  gint           height,
+                                  gboolean       alpha,
+                                  gint           offsetx,
+                                  gint           offsety,
+                                  gpointer       user_data);
+
+/* Duration of each frame in an exported animation (milliseconds) - frames
+ * added with the same timestamp would each last 0 ms */
+#define FRAME_DURATION 100
+
+/* Animation written chunk by chunk as frames become available */
+typedef struct {
+    WebPAsyncWriter *outfile;
+    guint32          size;     /* bytes written after the RIFF header */
+    gboolean         alpha;    /* any frame with transparency */
+} WebPAnimStream;
+#endif
+
+gboolean webp_preset_is_auto(const gchar *name);
+
+WebPPreset webp_preset_by_name(gchar *name);
+
+const gchar *webp_error_string(WebPEncodingError error_code);
+
+int webp_deadline_progress(int                percent,
+                           const WebPPicture *picture);
+
+void webp_config_from_params(WebPConfig     *config,
+                             WebPSaveParams *params);
+
+void webp_config_fit_budget(WebPConfig *config,
+                            gint        pixels,
+                            gboolean    alpha,
+                            gint        budget);
+
+gint webp_default_memory_budget(void);
+
+gint64 webp_memory_budget_bytes(gint budget);
+
+gint64 webp_encode_memory(const WebPConfig *config,
+                          gint              width,
+                          gint              height,
+                          gboolean          alpha);
+
+gboolean webp_config_auto(WebPConfig           *config,
+                          const WebPPicture    *picture,
+                          const WebPSaveParams *params);
+
+void webp_trial_configs(const WebPConfig *config,
+                        WebPConfig        trials[TRIAL_COUNT]);
+
+gint64 webp_trials_memory(const WebPConfig *config,
+                          gint              width,
+                          gint              height,
+                          gboolean          alpha);
+
+gboolean import_rows(WebPPicture  *picture,
+                     const guchar *rows,
+                     gint          y,
+                     gint          nrows,
+                     gint          bpp);
+
+gboolean read_strips(WebPPicture   *picture,
+                     gint           width,
+                     gint           height,
+                     gint           bpp,
+                     gint           strip_height,
+                     WebPStripFunc  func,
+                     gpointer       user_data,
+                     gboolean      *opaque,
+                     WebPStats     *stats,
+                     GError       **error);
+
+gboolean encode_with_budget(WebPConfig  *config,
+                            WebPPicture *picture,
+                            gint         budget);
+
+gboolean encode_smallest(const WebPConfig *config,
+                         WebPPicture      *picture,
+                         gint              time_budget);
+
+gboolean encode_picture(const WebPConfig     *config,
+                        WebPPicture          *picture,
+                        const WebPSaveParams *params,
+                        gboolean              alpha,
+                        WebPStats            *stats,
+                        GError              **error);
+
+gboolean encode_pixels(const WebPConfig     *config,
+                       const WebPSaveParams *params,
+                       const guchar         *pixels,
+                       gint                  width,
+                       gint                  height,
+                       gint                  bpp,
+                       WebPMemoryWriter     *memory,
+                       WebPStats            *stats,
+                       GError              **error);
+
+VP8StatusCode decode_incremental(const uint8_t *data,
+                                 size_t         data_size,
+                                 gboolean       alpha,
+                                 gint           width,
+                                 gint           height,
+                                 WebPRowsFunc   func,
+                                 gpointer       user_data);
+
+#ifdef WEBP_0_5
+gboolean decode_frames(WebPDemuxer   *demux,
+                       WebPFrameFunc  func,
+                       gpointer       user_data,
+                       WebPStats     *stats,
+                       GError       **error);
+
+gboolean anim_stream_begin(WebPAnimStream  *stream,
+                           WebPAsyncWriter *outfile,
+                           gint             width,
+                           gint             height,
+                           gboolean         loop,
+                           GError         **error);
+
+gboolean anim_stream_add_frame(WebPAnimStream *stream,
+                               const uint8_t  *data,
+                               size_t          data_size,
+                               gint            width,
+                               gint            height,
+                               gint            duration,
+                               gboolean        alpha,
+                               GError        **error);
+
+gboolean anim_stream_end(WebPAnimStream *stream,
+                         GError        **error);
+#endif
+
+#endif /* __WEBP_CODEC_H__ */
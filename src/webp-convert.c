@@ -0,0 +1,264 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "webp-convert.h"
+
+/* x86 kernels are compiled for their own instruction set and selected at
+ * runtime, so the plug-in still runs on older processors */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define CONVERT_X86
+#  include <immintrin.h>
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#  define CONVERT_NEON
+#  include <arm_neon.h>
+#endif
+
+ConvertRowFunc      convert_rgb_row  = NULL;
+ConvertAlphaRowFunc convert_rgba_row = NULL;
+
+/* Every set of converters the processor supports, from the plain C one to
+ * the fastest - the tests and the benchmark compare them */
+ConvertKernels convert_kernels[3];
+gint           convert_kernel_count = 0;
+
+/* Plain C versions - these also handle the pixels left over by the vector
+ * versions at the end of each row */
+void convert_rgb_row_c(const guchar *src,
+                       uint32_t     *dst,
+                       gint          width)
+{
+    gint x;
+
+    for (x = 0; x < width; ++x, src += 3) {
+        dst[x] = 0xff000000u | (src[0] << 16) | (src[1] << 8) | src[2];
+    }
+}
+
+/* RGBA versions also report whether every pixel in the row is opaque */
+gboolean convert_rgba_row_c(const guchar *src,
+                            uint32_t     *dst,
+                            gint          width)
+{
+    guchar alpha = 0xff;
+    gint   x;
+
+    for (x = 0; x < width; ++x, src += 4) {
+        dst[x] = ((uint32_t)src[3] << 24) | (src[0] << 16) |
+                 (src[1] << 8) | src[2];
+        alpha &= src[3];
+    }
+
+    return alpha == 0xff;
+}
+
+/* Make a set of converters available, the last one added being used */
+void convert_add_kernels(const gchar        *name,
+                         ConvertRowFunc      rgb,
+                         ConvertAlphaRowFunc rgba)
+{
+    convert_kernels[convert_kernel_count].name = name;
+    convert_kernels[convert_kernel_count].rgb  = rgb;
+    convert_kernels[convert_kernel_count].rgba = rgba;
+    ++convert_kernel_count;
+
+    convert_rgb_row  = rgb;
+    convert_rgba_row = rgba;
+}
+
+#ifdef CONVERT_X86
+/* Swapping R and B turns RGBA bytes into little-endian ARGB words */
+__attribute__((target("ssse3")))
+gboolean convert_rgba_row_ssse3(const guchar *src,
+                                uint32_t     *dst,
+                                gint          width)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                          10, 9, 8, 11, 14, 13, 12, 15);
+    const __m128i ones    = _mm_set1_epi8(-1);
+    __m128i       acc     = ones;
+    gint          x;
+
+    for (x = 0; x + 4 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + x * 4));
+        acc = _mm_and_si128(acc, v);
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_shuffle_epi8(v, shuffle));
+    }
+
+    /* Only the alpha bytes (every fourth one) matter */
+    return (convert_rgba_row_c(src + x * 4, dst + x, width - x) &&
+            (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, ones)) & 0x8888) == 0x8888);
+}
+
+/* Spread four RGB pixels over four words and fill in the alpha */
+__attribute__((target("ssse3")))
+void convert_rgb_row_ssse3(const guchar *src,
+                           uint32_t     *dst,
+                           gint          width)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+                                          8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i alpha   = _mm_set1_epi32((int)0xff000000u);
+    gint x;
+
+    /* Each load reads 16 bytes for 12 bytes of pixels, so stop while the
+     * extra four bytes are still within the row */
+    for (x = 0; x + 6 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + x * 3));
+        v = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha);
+        _mm_storeu_si128((__m128i*)(dst + x), v);
+    }
+
+    convert_rgb_row_c(src + x * 3, dst + x, width - x);
+}
+
+__attribute__((target("avx2")))
+gboolean convert_rgba_row_avx2(const guchar *src,
+                               uint32_t     *dst,
+                               gint          width)
+{
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                             10, 9, 8, 11, 14, 13, 12, 15,
+                                             2, 1, 0, 3, 6, 5, 4, 7,
+                                             10, 9, 8, 11, 14, 13, 12, 15);
+    const __m256i ones    = _mm256_set1_epi8(-1);
+    __m256i       acc     = ones;
+    gint          x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + x * 4));
+        acc = _mm256_and_si256(acc, v);
+        _mm256_storeu_si256((__m256i*)(dst + x), _mm256_shuffle_epi8(v, shuffle));
+    }
+
+    return (convert_rgba_row_ssse3(src + x * 4, dst + x, width - x) &&
+            ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(acc, ones)) &
+                0x88888888u) == 0x88888888u);
+}
+
+/* Pick the best versions supported by the processor */
+void convert_init(void)
+{
+    __builtin_cpu_init();
+
+    convert_add_kernels("c", convert_rgb_row_c, convert_rgba_row_c);
+
+    if (__builtin_cpu_supports("ssse3")) {
+        convert_add_kernels("ssse3",
+                            convert_rgb_row_ssse3,
+                            convert_rgba_row_ssse3);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        convert_add_kernels("avx2",
+                            convert_rgb_row_ssse3,
+                            convert_rgba_row_avx2);
+    }
+}
+#elif defined(CONVERT_NEON)
+void convert_rgb_row_neon(const guchar *src,
+                          uint32_t     *dst,
+                          gint          width)
+{
+    uint8x16x4_t out;
+    gint         x;
+
+    out.val[3] = vdupq_n_u8(0xff);
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        uint8x16x3_t in = vld3q_u8(src + x * 3);
+        out.val[0] = in.val[2];
+        out.val[1] = in.val[1];
+        out.val[2] = in.val[0];
+        vst4q_u8((uint8_t*)(dst + x), out);
+    }
+
+    convert_rgb_row_c(src + x * 3, dst + x, width - x);
+}
+
+gboolean convert_rgba_row_neon(const guchar *src,
+                               uint32_t     *dst,
+                               gint          width)
+{
+    uint8x16_t acc = vdupq_n_u8(0xff);
+    uint8x8_t  half;
+    gint       x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        uint8x16x4_t v = vld4q_u8(src + x * 4);
+        uint8x16_t   r = v.val[0];
+        acc = vandq_u8(acc, v.val[3]);
+        v.val[0] = v.val[2];
+        v.val[2] = r;
+        vst4q_u8((uint8_t*)(dst + x), v);
+    }
+
+    half = vand_u8(vget_low_u8(acc), vget_high_u8(acc));
+
+    return (convert_rgba_row_c(src + x * 4, dst + x, width - x) &&
+            vget_lane_u64(vreinterpret_u64_u8(half), 0) == ~(uint64_t)0);
+}
+
+void convert_init(void)
+{
+    convert_add_kernels("c", convert_rgb_row_c, convert_rgba_row_c);
+    convert_add_kernels("neon", convert_rgb_row_neon, convert_rgba_row_neon);
+}
+#else
+void convert_init(void)
+{
+    convert_add_kernels("c", convert_rgb_row_c, convert_rgba_row_c);
+}
+#endif
+
+/* Select the conversion functions the first time they are needed */
+void convert_ensure_init(void)
+{
+    static gsize initialized = 0;
+
+    if (g_once_init_enter(&initialized)) {
+        convert_init();
+        g_once_init_leave(&initialized, 1);
+    }
+}
+
+/* Retrieve every set of converters the processor supports, the plain C
+ * one first and the one in use last */
+gint convert_get_kernels(const ConvertKernels **kernels)
+{
+    convert_ensure_init();
+    *kernels = convert_kernels;
+    return convert_kernel_count;
+}
+
+/* Convert a row of RGB pixels to the ARGB words used by WebPPicture */
+void convert_rgb_to_argb(const guchar *src,
+                         uint32_t     *dst,
+                         gint          width)
+{
+    convert_ensure_init();
+    convert_rgb_row(src, dst, width);
+}
+
+/* Convert a row of RGBA pixels to the ARGB words used by WebPPicture,
+ * returning TRUE if all of them are fully opaque */
+gboolean convert_rgba_to_argb(const guchar *src,
+                              uint32_t     *dst,
+                              gint          width)
+{
+    convert_ensure_init();
+    return convert_rgba_row(src, dst, width);
+}
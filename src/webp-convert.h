@@ -0,0 +1,50 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WEBP_CONVERT_H__
+#define __WEBP_CONVERT_H__
+
+#include <glib.h>
+#include <stdint.h>
+
+typedef void (*ConvertRowFunc)(const guchar *src,
+                               uint32_t     *dst,
+                               gint          width);
+
+typedef gboolean (*ConvertAlphaRowFunc)(const guchar *src,
+                                        uint32_t     *dst,
+                                        gint          width);
+
+/* A set of row converters for one instruction set */
+typedef struct {
+    const gchar        *name;
+    ConvertRowFunc      rgb;
+    ConvertAlphaRowFunc rgba;
+} ConvertKernels;
+
+gint convert_get_kernels(const ConvertKernels **kernels);
+
+void convert_rgb_to_argb(const guchar *src,
+                         uint32_t     *dst,
+                         gint          width);
+
+gboolean convert_rgba_to_argb(const guchar *src,
+                              uint32_t     *dst,
+                              gint          width);
+
+#endif /* __WEBP_CONVERT_H__ */
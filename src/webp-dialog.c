@@ -18,15 +18,54 @@
 
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
+#include <stdlib.h>
 
 #include "webp-dialog.h"
 #include "webp.h"
 
+/* Size of the region in the middle of the drawable that is encoded for the
+ * preview - the estimates are scaled up from it */
+#define PREVIEW_SIZE  256
+
+/* Time to wait after the last change before encoding the preview (ms) */
+#define PREVIEW_DELAY 300
+
+/* Background encoding of the preview region - changing any option bumps
+ * the generation, which makes an encode in progress abort itself */
+typedef struct {
+    WebPSaveParams *params;
+    guchar         *pixels;         /* preview region */
+    gint            width;
+    gint            height;
+    gint            bpp;
+    gdouble         scale;          /* drawable pixels per preview pixel */
+    GtkWidget      *image;
+    GtkWidget      *label;
+    GThreadPool    *pool;
+    guint           timeout_id;
+    volatile gint   generation;
+
+    /* Result handed over by the encoding thread */
+    GMutex          mutex;
+    guint           idle_id;
+    GdkPixbuf      *pixbuf;
+    gsize           size;
+    gint64          encode_time;
+} WebPPreview;
+
+/* A request to encode the preview with a snapshot of the options */
+typedef struct {
+    WebPPreview    *preview;
+    WebPSaveParams  params;
+    gint            generation;
+} WebPPreviewJob;
+
 struct {
     const gchar *id;
     const gchar *label;
 } presets[] = {
     { "default", "Default" },
+    { "auto",    "Automatic" },
     { "picture", "Picture" },
     { "photo",   "Photo" },
     { "drawing", "Drawing" },
@@ -80,17 +119,267 @@ void save_dialog_toggle_scale(GtkWidget *widget,
                                    !gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget)));
 }
 
-#ifdef WEBP_0_5
 void save_dialog_toggle_checkbox(GtkWidget *widget,
                                  gpointer   data)
 {
     gtk_widget_set_sensitive(GTK_OBJECT(data),
                              !gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget)));
 }
-#endif
+
+/* Abort the encode once its result is no longer wanted */
+int save_dialog_preview_progress(int                percent,
+                                 const WebPPicture *picture)
+{
+    WebPPreviewJob *job = (WebPPreviewJob*)picture->user_data;
+
+    return job->generation == g_atomic_int_get(&job->preview->generation);
+}
+
+void save_dialog_preview_free_pixels(guchar  *pixels,
+                                     gpointer data)
+{
+    free(pixels);
+}
+
+/* Display the result of the latest encode */
+gboolean save_dialog_preview_show(gpointer data)
+{
+    WebPPreview *preview = (WebPPreview*)data;
+    GdkPixbuf   *pixbuf;
+    gsize        size;
+    gint64       encode_time;
+    gchar       *size_text;
+    gchar       *text;
+
+    g_mutex_lock(&preview->mutex);
+    preview->idle_id = 0;
+    pixbuf           = preview->pixbuf;
+    size             = preview->size;
+    encode_time      = preview->encode_time;
+    preview->pixbuf  = NULL;
+    g_mutex_unlock(&preview->mutex);
+
+    if (!pixbuf) {
+        gtk_label_set_text(GTK_LABEL(preview->label), "Preview unavailable");
+        return FALSE;
+    }
+
+    size_text = g_format_size((guint64)(size * preview->scale));
+    text = g_strdup_printf("Estimated size: %s\nEstimated encoding time: %.1f s",
+                           size_text,
+                           encode_time * preview->scale / 1e6);
+    gtk_label_set_text(GTK_LABEL(preview->label), text);
+    gtk_image_set_from_pixbuf(GTK_IMAGE(preview->image), pixbuf);
+
+    g_object_unref(pixbuf);
+    g_free(size_text);
+    g_free(text);
+
+    return FALSE;
+}
+
+/* Encode the preview region and decode it again on the preview thread */
+void save_dialog_preview_encode(gpointer data,
+                                gpointer user_data)
+{
+    WebPPreviewJob   *job         = (WebPPreviewJob*)data;
+    WebPPreview      *preview     = (WebPPreview*)user_data;
+    WebPConfig        config;
+    WebPPicture       picture;
+    WebPMemoryWriter  memory;
+    GdkPixbuf        *pixbuf      = NULL;
+    uint8_t          *rgba;
+    gint64            encode_time = 0;
+    int               width;
+    int               height;
+
+    WebPMemoryWriterInit(&memory);
+    WebPPictureInit(&picture);
+
+    do {
+        /* Skip requests superseded while they were queued */
+        if (job->generation != g_atomic_int_get(&preview->generation)) {
+            break;
+        }
+
+        picture.use_argb      = 1;
+        picture.width         = preview->width;
+        picture.height        = preview->height;
+        picture.writer        = WebPMemoryWrite;
+        picture.custom_ptr    = &memory;
+        picture.progress_hook = save_dialog_preview_progress;
+        picture.user_data     = job;
+
+        if (!WebPPictureAlloc(&picture)) {
+            break;
+        }
+
+        import_rows(&picture, preview->pixels, 0, preview->height, preview->bpp);
+
+        /* Use the same settings as an export of the whole drawable */
+        webp_config_from_params(&config, &job->params);
+        webp_config_auto(&config, &picture, &job->params);
+        if (job->params.time_budget > 0) {
+            webp_config_fit_budget(&config,
+                                   (gint)(preview->width * preview->height *
+                                          preview->scale),
+                                   preview->bpp == 4,
+                                   job->params.time_budget);
+        }
+        if (config.target_size > 0) {
+            config.target_size = MAX((gint)(config.target_size / preview->scale), 1);
+        }
+
+        encode_time = g_get_monotonic_time();
+        if (job->params.trials ?
+                !encode_smallest(&config, &picture, 0) :
+                !WebPEncode(&config, &picture)) {
+            break;
+        }
+        encode_time = g_get_monotonic_time() - encode_time;
+
+        /* Decode the result to show what the export will look like */
+        rgba = WebPDecodeRGBA(memory.mem, memory.size, &width, &height);
+        if (rgba) {
+            pixbuf = gdk_pixbuf_new_from_data(rgba,
+                                              GDK_COLORSPACE_RGB,
+                                              TRUE, 8,
+                                              width, height,
+                                              width * 4,
+                                              save_dialog_preview_free_pixels,
+                                              NULL);
+        }
+    } while(0);
+
+    /* Hand the result to the main loop unless the options have changed */
+    g_mutex_lock(&preview->mutex);
+    if (job->generation == g_atomic_int_get(&preview->generation)) {
+        if (preview->pixbuf) {
+            g_object_unref(preview->pixbuf);
+        }
+        preview->pixbuf      = pixbuf;
+        preview->size        = memory.size;
+        preview->encode_time = encode_time;
+        pixbuf               = NULL;
+
+        if (!preview->idle_id) {
+            preview->idle_id = g_idle_add(save_dialog_preview_show, preview);
+        }
+    }
+    g_mutex_unlock(&preview->mutex);
+
+    if (pixbuf) {
+        g_object_unref(pixbuf);
+    }
+
+    WebPPictureFree(&picture);
+    WebPMemoryWriterClear(&memory);
+    g_free(job->params.preset);
+    g_free(job);
+}
+
+/* Queue an encode with the current options */
+gboolean save_dialog_preview_start(gpointer data)
+{
+    WebPPreview    *preview = (WebPPreview*)data;
+    WebPPreviewJob *job     = g_new0(WebPPreviewJob, 1);
+
+    preview->timeout_id = 0;
+
+    job->preview       = preview;
+    job->params        = *preview->params;
+    job->params.preset = g_strdup(preview->params->preset);
+    job->generation    = g_atomic_int_get(&preview->generation);
+
+    g_thread_pool_push(preview->pool, job, NULL);
+
+    return FALSE;
+}
+
+/* Restart the delay before the preview is encoded again - called whenever
+ * an option changes, after the option itself has been updated */
+void save_dialog_preview_queue(GtkWidget *widget,
+                               gpointer   data)
+{
+    WebPPreview *preview = (WebPPreview*)data;
+
+    if (!preview->pixels) {
+        return;
+    }
+
+    /* Abandon the encode in progress */
+    g_atomic_int_inc(&preview->generation);
+
+    if (preview->timeout_id) {
+        g_source_remove(preview->timeout_id);
+    }
+    preview->timeout_id = g_timeout_add(PREVIEW_DELAY,
+                                        save_dialog_preview_start,
+                                        preview);
+
+    gtk_label_set_text(GTK_LABEL(preview->label), "Updating preview...");
+}
+
+/* Read the region in the middle of the drawable used for the preview */
+WebPPreview *save_dialog_preview_new(WebPSaveParams *params,
+                                     gint32          drawable_ID)
+{
+    WebPPreview *preview = g_new0(WebPPreview, 1);
+    gint         width   = gimp_drawable_width(drawable_ID);
+    gint         height  = gimp_drawable_height(drawable_ID);
+
+    preview->params = params;
+    preview->width  = MIN(width, PREVIEW_SIZE);
+    preview->height = MIN(height, PREVIEW_SIZE);
+    preview->scale  = (gdouble)width * height / (preview->width * preview->height);
+
+    preview->pixels = gimp_drawable_get_sub_thumbnail_data(drawable_ID,
+                                                           (width - preview->width) / 2,
+                                                           (height - preview->height) / 2,
+                                                           preview->width,
+                                                           preview->height,
+                                                           &preview->width,
+                                                           &preview->height,
+                                                           &preview->bpp);
+
+    /* Only RGB and RGBA drawables can be encoded */
+    if (preview->pixels && preview->bpp != 3 && preview->bpp != 4) {
+        g_free(preview->pixels);
+        preview->pixels = NULL;
+    }
+
+    /* A single thread is enough, since only the latest request matters */
+    g_mutex_init(&preview->mutex);
+    preview->pool = g_thread_pool_new(save_dialog_preview_encode, preview,
+                                      1, FALSE, NULL);
+
+    return preview;
+}
+
+void save_dialog_preview_free(WebPPreview *preview)
+{
+    /* Cancel the encode in progress and wait for the thread to finish */
+    g_atomic_int_inc(&preview->generation);
+    g_thread_pool_free(preview->pool, FALSE, TRUE);
+
+    if (preview->timeout_id) {
+        g_source_remove(preview->timeout_id);
+    }
+    if (preview->idle_id) {
+        g_source_remove(preview->idle_id);
+    }
+    if (preview->pixbuf) {
+        g_object_unref(preview->pixbuf);
+    }
+
+    g_mutex_clear(&preview->mutex);
+    g_free(preview->pixels);
+    g_free(preview);
+}
 
 GtkResponseType save_dialog(
         WebPSaveParams *params
+      , gint32 drawable_ID
 #ifdef WEBP_0_5
       , gint32 image_ID
       , gint32 nLayers
@@ -107,6 +396,10 @@ GtkResponseType save_dialog(
     GtkObject       *quality_scale;
     GtkObject       *alpha_quality_scale;
     GtkWidget       *lossless_checkbox;
+    GtkWidget       *trials_checkbox;
+    GtkWidget       *preview_frame;
+    GtkWidget       *preview_vbox;
+    WebPPreview     *preview;
 #ifdef WEBP_0_5
     GtkWidget       *animation_checkbox;
     GtkWidget       *loop_anim_checkbox;
@@ -153,9 +446,9 @@ GtkResponseType save_dialog(
     /* Create the table */
     table = gtk_table_new(
 #ifdef WEBP_0_5
-                animation_supported == TRUE ? 6 : 4
+                animation_supported == TRUE ? 7 : 5
 #else
-                4
+                5
 #endif
               , 3
               , FALSE
@@ -252,6 +545,27 @@ GtkResponseType save_dialog(
                      G_CALLBACK(save_dialog_toggle_scale),
                      alpha_quality_scale);
 
+    /* Create the checkbox for trying both lossy and lossless encoding */
+    trials_checkbox = gtk_check_button_new_with_label("Keep the smaller of lossy and lossless");
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(trials_checkbox), params->trials);
+    gtk_widget_set_sensitive(lossless_checkbox, !params->trials);
+    gtk_table_attach(GTK_TABLE(table),
+                     trials_checkbox,
+                     1, 3,
+                     4, 5,
+                     GTK_FILL, GTK_FILL,
+                     0, 0);
+    gtk_widget_show(trials_checkbox);
+
+    g_signal_connect(trials_checkbox, "toggled",
+                     G_CALLBACK(gimp_toggle_button_update),
+                     &params->trials);
+
+    /* Both are tried, so the lossless option no longer applies */
+    g_signal_connect(trials_checkbox, "toggled",
+                     G_CALLBACK(save_dialog_toggle_checkbox),
+                     lossless_checkbox);
+
 #ifdef WEBP_0_5
     if (animation_supported == TRUE) {
 
@@ -261,7 +575,7 @@ GtkResponseType save_dialog(
         gtk_table_attach(GTK_TABLE(table),
                          animation_checkbox,
                          1, 3,
-                         4, 5,
+                         5, 6,
                          GTK_FILL, GTK_FILL,
                          0, 0);
         gtk_widget_show(animation_checkbox);
@@ -276,7 +590,7 @@ GtkResponseType save_dialog(
         gtk_table_attach(GTK_TABLE(table),
                          loop_anim_checkbox,
                          1, 3,
-                         5, 6,
+                         6, 7,
                          GTK_FILL, GTK_FILL,
                          0, 0);
         gtk_widget_show(loop_anim_checkbox);
@@ -292,9 +606,52 @@ GtkResponseType save_dialog(
     }
 #endif
 
+    /* Create the preview of the region in the middle of the drawable */
+    preview = save_dialog_preview_new(params, drawable_ID);
+
+    preview_frame = gtk_frame_new("Preview");
+    gtk_box_pack_start(GTK_BOX(vbox), preview_frame, FALSE, FALSE, 0);
+    gtk_widget_show(preview_frame);
+
+    preview_vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 6);
+    gtk_container_set_border_width(GTK_CONTAINER(preview_vbox), 6);
+    gtk_container_add(GTK_CONTAINER(preview_frame), preview_vbox);
+    gtk_widget_show(preview_vbox);
+
+    preview->image = gtk_image_new();
+    gtk_widget_set_size_request(preview->image, PREVIEW_SIZE, PREVIEW_SIZE);
+    gtk_box_pack_start(GTK_BOX(preview_vbox), preview->image, FALSE, FALSE, 0);
+    gtk_widget_show(preview->image);
+
+    preview->label = gtk_label_new("Preview unavailable");
+    gtk_box_pack_start(GTK_BOX(preview_vbox), preview->label, FALSE, FALSE, 0);
+    gtk_widget_show(preview->label);
+
+    /* Encode the preview again whenever an option changes - these handlers
+     * run after the ones above have updated the parameters */
+    g_signal_connect(preset_combo, "changed",
+                     G_CALLBACK(save_dialog_preview_queue),
+                     preview);
+    g_signal_connect(quality_scale, "value-changed",
+                     G_CALLBACK(save_dialog_preview_queue),
+                     preview);
+    g_signal_connect(alpha_quality_scale, "value-changed",
+                     G_CALLBACK(save_dialog_preview_queue),
+                     preview);
+    g_signal_connect(lossless_checkbox, "toggled",
+                     G_CALLBACK(save_dialog_preview_queue),
+                     preview);
+    g_signal_connect(trials_checkbox, "toggled",
+                     G_CALLBACK(save_dialog_preview_queue),
+                     preview);
+
+    save_dialog_preview_queue(NULL, preview);
+
     /* Display the dialog and enter the main event loop */
     gtk_widget_show(dialog);
     gtk_main();
 
+    save_dialog_preview_free(preview);
+
     return response;
 }
@@ -26,6 +26,7 @@
 
 GtkResponseType save_dialog(
         WebPSaveParams *params
+      , gint32 drawable_ID
 #ifdef WEBP_0_5
       , gint32 image_ID
       , gint32 nLayers
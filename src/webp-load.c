@@ -19,102 +19,414 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <libgimp/gimp.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <webp/decode.h>
-#include <webp/mux.h>
+#include <webp/demux.h>
 
 #include "config.h"
+#include "webp-codec.h"
 #include "webp-load.h"
+#include "webp-stats.h"
 
 #ifdef GIMP_2_9
 #  include <gegl.h>
 #endif
 
-/* Create a layer with the provided image data and add it to the image */
-gboolean create_layer(gint32   image_ID,
-                      uint8_t *layer_data,
-                      gint32   position,
-                      gchar   *name,
-                      gint     width,
-                      gint     height,
-                      gint32   offsetx,
-                      gint32   offsety)
-{
+/* Destination for the rows produced by the incremental decoder */
+typedef struct {
     gint32        layer_ID;
+    gint          width;
+    gint          height;
+    gint          rows_done;
+    WebPStats    *stats;      /* time spent copying rows, or NULL */
 #ifdef GIMP_2_9
     GeglBuffer   *geglbuffer;
-    GeglRectangle extent;
 #else
     GimpDrawable *drawable;
     GimpPixelRgn  region;
 #endif
-
-    layer_ID = gimp_layer_new(image_ID,
-                              name,
-                              width, height,
-	                          GIMP_RGBA_IMAGE,
-	                          100,
-                              GIMP_NORMAL_MODE);
+} WebPLayerWriter;
+
+/* Create an empty layer and prepare it for receiving rows - layers without
+ * an alpha channel receive RGB rows rather than RGBA */
+void layer_writer_begin(WebPLayerWriter *writer,
+                        gint32           image_ID,
+                        gchar           *name,
+                        gint             width,
+                        gint             height,
+                        gboolean         alpha)
+{
+    writer->width     = width;
+    writer->height    = height;
+    writer->rows_done = 0;
+    writer->stats     = NULL;
+    writer->layer_ID  = gimp_layer_new(image_ID,
+                                       name,
+                                       width, height,
+                                       alpha ? GIMP_RGBA_IMAGE : GIMP_RGB_IMAGE,
+                                       100,
+                                       GIMP_NORMAL_MODE);
 
 #ifdef GIMP_2_9
-	/* Retrieve the buffer for the layer */
-	geglbuffer = gimp_drawable_get_buffer(layer_ID);
-
-	/* Copy the image data to the region */
-    gegl_rectangle_set(&extent, 0, 0, width, height);
-    gegl_buffer_set(geglbuffer, &extent, 0, NULL, layer_data, GEGL_AUTO_ROWSTRIDE);
-
-	/* Flush the drawable and detach */
-    gegl_buffer_flush(geglbuffer);
-
-	g_object_unref(geglbuffer);
+    /* Retrieve the buffer for the layer */
+    writer->geglbuffer = gimp_drawable_get_buffer(writer->layer_ID);
 #else
     /* Retrieve the drawable for the layer */
-    drawable = gimp_drawable_get(layer_ID);
+    writer->drawable = gimp_drawable_get(writer->layer_ID);
 
     /* Get a pixel region from the layer */
-    gimp_pixel_rgn_init(&region,
-                        drawable,
+    gimp_pixel_rgn_init(&writer->region,
+                        writer->drawable,
                         0, 0,
                         width, height,
                         FALSE, FALSE);
+#endif
+}
+
+/* Copy a strip of rows, starting at the first row not yet written */
+void layer_writer_write(WebPLayerWriter *writer,
+                        const uint8_t   *rows,
+                        gint             nrows,
+                        gint             stride)
+{
+    gint64 start = g_get_monotonic_time();
+#ifdef GIMP_2_9
+    GeglRectangle extent;
 
-    /* Copy the image data to the region */
-    gimp_pixel_rgn_set_rect(&region,
-                            layer_data,
-                            0, 0,
-                            width, height);
+    /* Copy the new strip to the buffer */
+    gegl_rectangle_set(&extent,
+                       0, writer->rows_done,
+                       writer->width, nrows);
+    gegl_buffer_set(writer->geglbuffer, &extent, 0, NULL, rows, stride);
+#else
+    /* Copy the new strip to the region - the region expects packed rows,
+     * so rows cut from a wider buffer are copied one at a time */
+    if (stride == writer->width * (gint)writer->drawable->bpp) {
+        gimp_pixel_rgn_set_rect(&writer->region,
+                                (guchar*)rows,
+                                0, writer->rows_done,
+                                writer->width, nrows);
+    } else {
+        gint i;
+
+        for (i = 0; i < nrows; ++i) {
+            gimp_pixel_rgn_set_row(&writer->region,
+                                   (guchar*)rows + i * stride,
+                                   0, writer->rows_done + i,
+                                   writer->width);
+        }
+    }
+#endif
+
+    writer->rows_done += nrows;
+
+    stats_add_time(writer->stats, STATS_LAYER, start);
+}
+
+/* Copy a strip of rows handed over by the incremental decoder */
+void layer_writer_rows(const uint8_t *rows,
+                       gint           y,
+                       gint           nrows,
+                       gint           stride,
+                       gpointer       user_data)
+{
+    layer_writer_write((WebPLayerWriter*)user_data, rows, nrows, stride);
+}
+
+/* Flush the layer and add it to the image */
+void layer_writer_end(WebPLayerWriter *writer,
+                      gint32           image_ID,
+                      gint32           position,
+                      gint32           offsetx,
+                      gint32           offsety)
+{
+    gint64 start = g_get_monotonic_time();
 
+#ifdef GIMP_2_9
+    /* Flush the drawable and detach */
+    gegl_buffer_flush(writer->geglbuffer);
+
+    g_object_unref(writer->geglbuffer);
+#else
     /* Flush the drawable and detach */
-    gimp_drawable_flush(drawable);
-    gimp_drawable_detach(drawable);
+    gimp_drawable_flush(writer->drawable);
+    gimp_drawable_detach(writer->drawable);
 #endif
 
     /* Add the new layer to the image */
-    gimp_image_insert_layer(image_ID, layer_ID, -1, position);
+    gimp_image_insert_layer(image_ID, writer->layer_ID, -1, position);
 
     /* If layer offsets were provided, use them to position the image */
     if (offsetx || offsety) {
-        gimp_layer_set_offsets(layer_ID, offsetx, offsety);
+        gimp_layer_set_offsets(writer->layer_ID, offsetx, offsety);
+    }
+
+    stats_add_time(writer->stats, STATS_LAYER, start);
+}
+
+/* Decode a bitstream into a new layer, one strip of rows at a time, so that
+ * the RGBA surface owned by the decoder is the only full-size copy */
+gboolean create_layer(gint32         image_ID,
+                      const uint8_t *data,
+                      size_t         data_size,
+                      gint32         position,
+                      gchar         *name,
+                      gint32         offsetx,
+                      gint32         offsety,
+                      WebPStats     *stats,
+                      GError       **error)
+{
+    gboolean               status     = FALSE;
+    WebPBitstreamFeatures  features;
+    VP8StatusCode          vp8_status;
+    WebPLayerWriter        writer;
+    gint64                 start;
+    gint64                 layer_time = 0;
+
+    /* Determine the dimensions of the bitstream and whether it has alpha */
+    if (WebPGetFeatures(data, data_size, &features) != VP8_STATUS_OK) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    0,
+                    "Invalid WebP bitstream");
+        return FALSE;
+    }
+
+    /* Opaque images are decoded without an alpha channel */
+    layer_writer_begin(&writer, image_ID, name,
+                       features.width, features.height, features.has_alpha);
+    writer.stats = stats;
+
+    /* Move each completed strip into the layer as soon as it is ready -
+     * the time spent copying rows is not counted as decoding */
+    if (stats) {
+        layer_time = stats->time[STATS_LAYER];
     }
 
-    /* TODO: fix this */
+    start      = g_get_monotonic_time();
+    vp8_status = decode_incremental(data, data_size,
+                                    features.has_alpha,
+                                    features.width, features.height,
+                                    layer_writer_rows, &writer);
+
+    if (stats) {
+        stats_add_time(stats, STATS_DECODE, start);
+        stats->time[STATS_DECODE] -= stats->time[STATS_LAYER] - layer_time;
+    }
+
+    if (vp8_status == VP8_STATUS_OK) {
+        status = TRUE;
+    } else {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    vp8_status,
+                    "Unable to decode WebP bitstream");
+    }
+
+    layer_writer_end(&writer, image_ID, position, offsetx, offsety);
+
+    return status;
+}
+
+#ifdef WEBP_0_5
+/* Destination for the frames of an animation */
+typedef struct {
+    gint32     image_ID;
+    WebPStats *stats;
+} WebPFrameLayers;
+
+/* Create a layer for a decoded frame */
+gboolean frame_layer(gint           index,
+                     const uint8_t *rgba,
+                     gint           width,
+                     gint           height,
+                     gboolean       alpha,
+                     gint           offsetx,
+                     gint           offsety,
+                     gpointer       user_data)
+{
+    WebPFrameLayers *layers = (WebPFrameLayers*)user_data;
+    WebPLayerWriter  writer;
+    char             name[255];
+
+    snprintf(name, 255, "Frame %d", (index + 1));
+
+    layer_writer_begin(&writer, layers->image_ID, (gchar*)name,
+                       width, height, alpha);
+    writer.stats = layers->stats;
+    layer_writer_write(&writer, rgba, height, width * (alpha ? 4 : 3));
+    layer_writer_end(&writer, layers->image_ID, 0, offsetx, offsety);
+
     return TRUE;
 }
 
+/* Decode the frames of an animation concurrently - layers can only be
+ * created from the main thread, so they are inserted there in order as each
+ * frame becomes available */
+gboolean load_animation(gint32       image_ID,
+                        WebPDemuxer *demux,
+                        WebPStats   *stats,
+                        GError     **error)
+{
+    WebPFrameLayers layers;
+
+    layers.image_ID = image_ID;
+    layers.stats    = stats;
+
+    return decode_frames(demux, frame_layer, &layers, stats, error);
+}
+
+/* Decode an animation as a sequence of fully composited canvases - the
+ * animation decoder applies blending and disposal, rebuilding each canvas
+ * from the previous one and only starting afresh at keyframes */
+gboolean load_composited_animation(gint32          image_ID,
+                                   const WebPData *wp_data,
+                                   WebPStats      *stats,
+                                   GError        **error)
+{
+    gboolean                status = TRUE;
+    WebPAnimDecoderOptions  dec_options;
+    WebPAnimDecoder        *dec;
+    WebPAnimInfo            anim_info;
+    uint8_t                *canvas;
+    int                     timestamp;
+    int                     i;
+    gint64                  start;
+
+    /* Prepare the decoder */
+    WebPAnimDecoderOptionsInit(&dec_options);
+    dec_options.color_mode  = MODE_RGBA;
+    dec_options.use_threads = 1;
+
+    dec = WebPAnimDecoderNew(wp_data, &dec_options);
+    if (!dec) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    0,
+                    "Unable to create animation decoder");
+        return FALSE;
+    }
+
+    WebPAnimDecoderGetInfo(dec, &anim_info);
+
+    /* Create a canvas-sized layer for each frame */
+    for (i = 1; WebPAnimDecoderHasMoreFrames(dec); ++i) {
+        WebPLayerWriter writer;
+        char            name[255];
+        gboolean        ok;
+
+        start = g_get_monotonic_time();
+        ok    = WebPAnimDecoderGetNext(dec, &canvas, &timestamp);
+        stats_add_time(stats, STATS_DECODE, start);
+
+        if (!ok) {
+            g_set_error(error,
+                        G_FILE_ERROR,
+                        0,
+                        "Unable to decode frame %d",
+                        i);
+            status = FALSE;
+            break;
+        }
+
+        snprintf(name, 255, "Frame %d", i);
+
+        layer_writer_begin(&writer, image_ID, (gchar*)name,
+                           anim_info.canvas_width, anim_info.canvas_height,
+                           TRUE);
+        writer.stats = stats;
+        layer_writer_write(&writer, canvas, anim_info.canvas_height,
+                           anim_info.canvas_width * 4);
+        layer_writer_end(&writer, image_ID, 0, 0, 0);
+    }
+
+    WebPAnimDecoderDelete(dec);
+
+    return status;
+}
+#endif
+
+/* Map a file into memory and walk its RIFF chunks once, validating the file
+ * in the process - every chunk is referenced in place rather than being
+ * copied out of the mapping, which must outlive the demuxer */
+WebPDemuxer *demux_file(const gchar  *filename,
+                        GMappedFile **mapped,
+                        WebPData     *wp_data,
+                        GError      **error)
+{
+    WebPDemuxer *demux;
+
+    *mapped = g_mapped_file_new(filename, FALSE, error);
+    if (*mapped == NULL) {
+        return NULL;
+    }
+
+    wp_data->bytes = (uint8_t*)g_mapped_file_get_contents(*mapped);
+    wp_data->size  = g_mapped_file_get_length(*mapped);
+
+    demux = WebPDemux(wp_data);
+    if (demux == NULL) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    0,
+                    "Invalid WebP file '%s'",
+                    gimp_filename_to_utf8(filename));
+    }
+
+    return demux;
+}
+
+/* Apply the file's ICC profile (if any) to the image */
+void load_color_profile(gint32       image_ID,
+                        WebPDemuxer *demux)
+{
+#ifdef GIMP_2_9
+    WebPChunkIterator  chunk_iter;
+    GimpColorProfile  *profile;
+
+    /* Locate the ICC profile within the file */
+    if (WebPDemuxGetChunk(demux, "ICCP", 1, &chunk_iter)) {
+
+        /* Have Gimp load the color profile */
+        profile = gimp_color_profile_new_from_icc_profile(
+                    chunk_iter.chunk.bytes, chunk_iter.chunk.size, NULL);
+        if (profile) {
+            gimp_image_set_color_profile(image_ID, profile);
+            g_object_unref(profile);
+        }
+
+        WebPDemuxReleaseChunkIterator(&chunk_iter);
+    }
+#endif
+}
+
 gboolean load_image(const gchar *filename,
+                    gboolean     composite,
                     gint32      *image_ID,
+                    WebPStats   *stats,
                     GError     **error)
 {
     gboolean              status      = FALSE;
-    gchar                *indata      = NULL;
-    gsize                 indatalen;
+    GMappedFile          *mapped      = NULL;
     gint                  width;
     gint                  height;
-    WebPMux              *mux         = NULL;
+    WebPDemuxer          *demux       = NULL;
     WebPData              wp_data;
     uint32_t              flags;
-    uint8_t              *outdata     = NULL;
+    WebPStats             log_stats;
+    gint64                start;
+
+    /* Statistics are always gathered when they are going to be logged */
+    if (!stats && stats_log_enabled()) {
+        stats = &log_stats;
+    }
+
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+    }
 
 #ifdef GIMP_2_9
     /* Initialize GEGL */
@@ -123,144 +435,352 @@ gboolean load_image(const gchar *filename,
 
     do {
 
-        /* Attempt to read the file contents from disk */
-        if (g_file_get_contents(filename,
-                                &indata,
-                                &indatalen,
-                                error) == FALSE) {
+        /* Map the file and walk its chunks */
+        start = g_get_monotonic_time();
+        demux = demux_file(filename, &mapped, &wp_data, error);
+        stats_add_time(stats, STATS_DEMUX, start);
+        if (demux == NULL) {
             break;
         }
 
-        /* Validate WebP data, grabbing the width and height */
-        if (!WebPGetInfo(indata, indatalen, &width, &height)) {
+        /* Retrieve the canvas size and the features present */
+        width  = WebPDemuxGetI(demux, WEBP_FF_CANVAS_WIDTH);
+        height = WebPDemuxGetI(demux, WEBP_FF_CANVAS_HEIGHT);
+        flags  = WebPDemuxGetI(demux, WEBP_FF_FORMAT_FLAGS);
+
+        /* Create the new image and associated layer */
+        *image_ID = gimp_image_new(width, height, GIMP_RGB);
+
+#ifdef WEBP_0_5
+        if (flags & ANIMATION_FLAG) {
+            if (composite == TRUE) {
+                status = load_composited_animation(*image_ID, &wp_data,
+                                                   stats, error);
+            } else {
+                status = load_animation(*image_ID, demux, stats, error);
+            }
+        } else {
+#endif
+
+            /* Decode the image straight into a single layer */
+            status = create_layer(*image_ID,
+                                  wp_data.bytes,
+                                  wp_data.size,
+                                  0,
+                                  "Background",
+                                  0, 0,
+                                  stats,
+                                  error);
+
+#ifdef WEBP_0_5
+        }
+#endif
+
+        if (stats) {
+            stats->frames = WebPDemuxGetI(demux, WEBP_FF_FRAME_COUNT);
+        }
+
+        /* Load a color profile if one was provided */
+        if (flags & ICCP_FLAG) {
+            load_color_profile(*image_ID, demux);
+        }
+
+        /* Set the filename for the image */
+        gimp_image_set_filename(*image_ID, filename);
+
+    } while(0);
+
+    /* Delete the demuxer before the memory it points into */
+    if (demux) {
+        WebPDemuxDelete(demux);
+    }
+
+    /* Unmap the file */
+    if (mapped) {
+        g_mapped_file_unref(mapped);
+    }
+
+    if (status && stats) {
+        stats_log("load", filename, wp_data.size, stats);
+    }
+
+    return status;
+}
+
+/* Load a thumbnail no larger than size x size, decoding only the first frame
+ * and letting the decoder scale it as it goes, so the cost depends on the
+ * size of the thumbnail rather than that of the image */
+gboolean load_thumbnail_image(const gchar *filename,
+                              gint         size,
+                              gint32      *image_ID,
+                              gint        *width,
+                              gint        *height,
+                              GError     **error)
+{
+    gboolean              status  = FALSE;
+    GMappedFile          *mapped  = NULL;
+    WebPDemuxer          *demux   = NULL;
+    WebPData              wp_data;
+    WebPIterator          iter;
+    WebPDecoderConfig     config;
+    WebPLayerWriter       writer;
+    gdouble               scale;
+
+#ifdef GIMP_2_9
+    /* Initialize GEGL */
+    gegl_init(NULL, NULL);
+#endif
+
+    WebPInitDecoderConfig(&config);
+
+    do {
+
+        /* Map the file and walk its chunks */
+        demux = demux_file(filename, &mapped, &wp_data, error);
+        if (demux == NULL) {
             break;
         }
 
-        /* Create a WebPMux from the contents of the file */
-        wp_data.bytes = (uint8_t*)indata;
-        wp_data.size = indatalen;
+        /* Report the full size of the image */
+        *width  = WebPDemuxGetI(demux, WEBP_FF_CANVAS_WIDTH);
+        *height = WebPDemuxGetI(demux, WEBP_FF_CANVAS_HEIGHT);
 
-        mux = WebPMuxCreate(&wp_data, 1);
-        if (mux == NULL) {
+        if (!WebPDemuxGetFrame(demux, 1, &iter)) {
+            g_set_error(error,
+                        G_FILE_ERROR,
+                        0,
+                        "Invalid WebP file '%s'",
+                        gimp_filename_to_utf8(filename));
             break;
         }
 
-        /* Retrieve the features present */
-        if (WebPMuxGetFeatures(mux, &flags) != WEBP_MUX_OK) {
+        /* Scale the canvas down to fit, but never up */
+        scale = MIN(1.0, (gdouble)size / MAX(*width, *height));
+
+        config.options.use_scaling   = 1;
+        config.options.scaled_width  = MAX(1, (gint)(iter.width * scale + 0.5));
+        config.options.scaled_height = MAX(1, (gint)(iter.height * scale + 0.5));
+        config.output.colorspace     = iter.has_alpha ? MODE_RGBA : MODE_RGB;
+
+        if (WebPDecode(iter.fragment.bytes,
+                       iter.fragment.size,
+                       &config) != VP8_STATUS_OK) {
+            g_set_error(error,
+                        G_FILE_ERROR,
+                        0,
+                        "Unable to decode '%s'",
+                        gimp_filename_to_utf8(filename));
+            WebPDemuxReleaseIterator(&iter);
             break;
         }
 
-        /* TODO: decode the image in "chunks" or "tiles" */
-        /* TODO: check if an alpha channel is present */
+        /* Create an image the size of the scaled canvas */
+        *image_ID = gimp_image_new(MAX(1, (gint)(*width * scale + 0.5)),
+                                   MAX(1, (gint)(*height * scale + 0.5)),
+                                   GIMP_RGB);
 
-        /* Create the new image and associated layer */
-        *image_ID = gimp_image_new(width, height, GIMP_RGB);
+        layer_writer_begin(&writer, *image_ID, "Background",
+                           config.output.width, config.output.height,
+                           iter.has_alpha);
+        layer_writer_write(&writer,
+                           config.output.u.RGBA.rgba,
+                           config.output.height,
+                           config.output.u.RGBA.stride);
+        layer_writer_end(&writer, *image_ID, 0,
+                         (gint32)(iter.x_offset * scale),
+                         (gint32)(iter.y_offset * scale));
 
-#ifdef WEBP_0_5
-        if (flags & ANIMATION_FLAG) {
-            int frames, i;
-
-            /* Retrieve the number of frames */
-            WebPMuxNumChunks(mux, WEBP_CHUNK_ANMF, &frames);
-
-            /* Loop over each of the frames */
-            for (i = 0; i < frames; ++i) {
-                WebPMuxFrameInfo frame = {0};
-
-                /* Retrieve the data for the frame */
-                if (WebPMuxGetFrame(mux, i, &frame) != WEBP_MUX_OK) {
-                    goto error;
-                }
-
-                /* Decode the frame */
-                outdata = WebPDecodeRGBA(frame.bitstream.bytes,
-                                         frame.bitstream.size,
-                                         &width, &height);
-
-                /* Free the compressed data */
-                WebPDataClear(&frame.bitstream);
-
-                if (!outdata) {
-                    goto error;
-                }
-
-                /* Create a layer for the frame */
-                char name[255];
-                snprintf(name, 255, "Frame %d", (i + 1));
-
-                if (create_layer(*image_ID,
-                                 outdata,
-                                 0,
-                                 (gchar*)name,
-                                 width, height,
-                                 frame.x_offset,
-                                 frame.y_offset) == FALSE) {
-                    goto error;
-                }
-            }
+        WebPDemuxReleaseIterator(&iter);
 
-            /* If all is well, jump *over* the error label - otherwise
-               leave the loop and begin cleaning things up */
+        status = TRUE;
 
-            goto success;
+    } while(0);
 
-        error:
-            break;
+    WebPFreeDecBuffer(&config.output);
 
-        success: ;
+    if (demux) {
+        WebPDemuxDelete(demux);
+    }
 
-        } else {
+    if (mapped) {
+        g_mapped_file_unref(mapped);
+    }
+
+    return status;
+}
+
+/* Load only part of an image, optionally scaled to a target size (0 keeps
+ * the size of the region) - each frame is cropped to the region and scaled
+ * by the decoder, so pixels outside the region are never materialized */
+gboolean load_region_image(const gchar *filename,
+                           gint         x,
+                           gint         y,
+                           gint         width,
+                           gint         height,
+                           gint         target_width,
+                           gint         target_height,
+                           gint32      *image_ID,
+                           GError     **error)
+{
+    gboolean              status  = FALSE;
+    GMappedFile          *mapped  = NULL;
+    WebPDemuxer          *demux   = NULL;
+    WebPData              wp_data;
+    WebPIterator          iter;
+    gint                  canvas_width;
+    gint                  canvas_height;
+    gint                  nframes;
+    uint32_t              flags;
+    gdouble               scalex;
+    gdouble               scaley;
+
+#ifdef GIMP_2_9
+    /* Initialize GEGL */
+    gegl_init(NULL, NULL);
 #endif
 
-            /* Attempt to decode the data as a WebP image */
-            outdata = WebPDecodeRGBA(indata, indatalen, &width, &height);
-            if (!outdata) {
+    do {
+
+        /* Map the file and walk its chunks */
+        demux = demux_file(filename, &mapped, &wp_data, error);
+        if (demux == NULL) {
+            break;
+        }
+
+        canvas_width  = WebPDemuxGetI(demux, WEBP_FF_CANVAS_WIDTH);
+        canvas_height = WebPDemuxGetI(demux, WEBP_FF_CANVAS_HEIGHT);
+        nframes       = WebPDemuxGetI(demux, WEBP_FF_FRAME_COUNT);
+        flags         = WebPDemuxGetI(demux, WEBP_FF_FORMAT_FLAGS);
+
+        /* Limit the region to the canvas */
+        width  = MIN(x + width, canvas_width) - MAX(x, 0);
+        height = MIN(y + height, canvas_height) - MAX(y, 0);
+        x      = MAX(x, 0);
+        y      = MAX(y, 0);
+
+        if (width <= 0 || height <= 0) {
+            g_set_error(error,
+                        G_FILE_ERROR,
+                        0,
+                        "The region lies outside of the image");
+            break;
+        }
+
+        target_width  = target_width > 0 ? target_width : width;
+        target_height = target_height > 0 ? target_height : height;
+        scalex        = (gdouble)target_width / width;
+        scaley        = (gdouble)target_height / height;
+
+        *image_ID = gimp_image_new(target_width, target_height, GIMP_RGB);
+
+        if (!WebPDemuxGetFrame(demux, 1, &iter)) {
+            break;
+        }
+
+        status = TRUE;
+
+        do {
+            WebPDecoderConfig config;
+            WebPLayerWriter   writer;
+            gint              left   = MAX(x, iter.x_offset);
+            gint              top    = MAX(y, iter.y_offset);
+            gint              right  = MIN(x + width, iter.x_offset + iter.width);
+            gint              bottom = MIN(y + height, iter.y_offset + iter.height);
+            gint              bpp    = iter.has_alpha ? 4 : 3;
+            gint              skip_x = 0;
+            gint              skip_y = 0;
+            gint              crop_left;
+            gint              crop_top;
+            uint8_t          *rows;
+            char              name[255];
+
+            /* Skip frames that do not touch the region */
+            if (right <= left || bottom <= top) {
+                continue;
+            }
+
+            WebPInitDecoderConfig(&config);
+            config.output.colorspace = iter.has_alpha ? MODE_RGBA : MODE_RGB;
+
+            /* Only decode the part of the frame inside the region - the
+             * decoder rounds the origin of lossy crops down to even, so crop
+             * from an even origin and account for the extra column/row */
+            crop_left = (left - iter.x_offset) & ~1;
+            crop_top  = (top - iter.y_offset) & ~1;
+            left      = iter.x_offset + crop_left;
+            top       = iter.y_offset + crop_top;
+
+            config.options.use_cropping = 1;
+            config.options.crop_left    = crop_left;
+            config.options.crop_top     = crop_top;
+            config.options.crop_width   = right - left;
+            config.options.crop_height  = bottom - top;
+
+            if (target_width != width || target_height != height) {
+                config.options.use_scaling   = 1;
+                config.options.scaled_width  = MAX(1, (gint)((right - left) * scalex + 0.5));
+                config.options.scaled_height = MAX(1, (gint)((bottom - top) * scaley + 0.5));
+            } else {
+                /* Unscaled: drop the extra column/row before the region */
+                skip_x = MAX(x - left, 0);
+                skip_y = MAX(y - top, 0);
+            }
+
+            if (WebPDecode(iter.fragment.bytes,
+                           iter.fragment.size,
+                           &config) != VP8_STATUS_OK) {
+                g_set_error(error,
+                            G_FILE_ERROR,
+                            0,
+                            "Unable to decode frame %d",
+                            iter.frame_num);
+                WebPFreeDecBuffer(&config.output);
+                status = FALSE;
                 break;
             }
 
-            /* Create a single layer */
-            status = create_layer(*image_ID,
-                                  outdata,
-                                  0,
-                                  "Background",
-                                  width, height,
-                                  0, 0);
+            if (nframes > 1) {
+                snprintf(name, 255, "Frame %d", iter.frame_num);
+            } else {
+                snprintf(name, 255, "Background");
+            }
 
-#ifdef WEBP_0_5
-        }
+            rows = config.output.u.RGBA.rgba +
+                   skip_y * config.output.u.RGBA.stride + skip_x * bpp;
+
+            /* A scaled layer keeps the extra column/row and starts just
+             * outside the region instead */
+            layer_writer_begin(&writer, *image_ID, (gchar*)name,
+                               config.output.width - skip_x,
+                               config.output.height - skip_y,
+                               iter.has_alpha);
+            layer_writer_write(&writer,
+                               rows,
+                               config.output.height - skip_y,
+                               config.output.u.RGBA.stride);
+            layer_writer_end(&writer, *image_ID, 0,
+                             (gint32)floor((left + skip_x - x) * scalex),
+                             (gint32)floor((top + skip_y - y) * scaley));
+
+            WebPFreeDecBuffer(&config.output);
+
+        } while (WebPDemuxNextFrame(&iter));
+
+        WebPDemuxReleaseIterator(&iter);
 
-#ifdef GIMP_2_9
         /* Load a color profile if one was provided */
         if (flags & ICCP_FLAG) {
-            WebPData          icc_profile;
-            GimpColorProfile *profile;
-
-            /* Load the ICC profile from the file */
-            WebPMuxGetChunk(mux, "ICCP", &icc_profile);
-
-            /* Have Gimp load the color profile */
-            profile = gimp_color_profile_new_from_icc_profile(
-                        icc_profile.bytes, icc_profile.size, NULL);
-            if (profile) {
-                gimp_image_set_color_profile(image_ID, profile);
-                g_object_unref(profile);
-            }
+            load_color_profile(*image_ID, demux);
         }
-#endif
-#endif
-        /* Set the filename for the image */
-        gimp_image_set_filename(*image_ID, filename);
 
     } while(0);
 
-    /* Delete the mux object */
-    if (mux) {
-        WebPMuxDelete(mux);
+    if (demux) {
+        WebPDemuxDelete(demux);
     }
 
-    /* Free the data read from disk */
-    if (indata) {
-        g_free(indata);
+    if (mapped) {
+        g_mapped_file_unref(mapped);
     }
 
     return status;
@@ -21,8 +21,29 @@
 
 #include <glib.h>
 
+#include "webp-stats.h"
+
 gboolean load_image(const gchar *filename,
+                    gboolean     composite,
                     gint32      *image_ID,
+                    WebPStats   *stats,
                     GError     **error);
 
+gboolean load_thumbnail_image(const gchar *filename,
+                              gint         size,
+                              gint32      *image_ID,
+                              gint        *width,
+                              gint        *height,
+                              GError     **error);
+
+gboolean load_region_image(const gchar *filename,
+                           gint         x,
+                           gint         y,
+                           gint         width,
+                           gint         height,
+                           gint         target_width,
+                           gint         target_height,
+                           gint32      *image_ID,
+                           GError     **error);
+
 #endif /* __WEBP_LOAD_H__ */
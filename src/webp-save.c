@@ -21,81 +21,143 @@
 #include <libgimp/gimp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <webp/encode.h>
 #include <webp/mux.h>
 
+#include "webp-cache.h"
 #include "webp-save.h"
+#include "webp-writer.h"
 
 #ifdef GIMP_2_9
 #  include <gegl.h>
 #endif
 
-/* Determine which WebP preset to use given its name */
-WebPPreset webp_preset_by_name(gchar *name)
-{
-    if (!strcmp(name, "picture")) {
-        return WEBP_PRESET_PICTURE;
-    } else if (!strcmp(name, "photo")) {
-        return WEBP_PRESET_PHOTO;
-    } else if (!strcmp(name, "drawing")) {
-        return WEBP_PRESET_DRAWING;
-    } else if (!strcmp(name, "icon")) {
-        return WEBP_PRESET_ICON;
-    } else if (!strcmp(name, "text")) {
-        return WEBP_PRESET_TEXT;
-    } else {
-        return WEBP_PRESET_DEFAULT;
-    }
-}
-
-/* Write the provided data to the file */
+/* Queue the provided data for writing to the file */
 int webp_file_writer(const uint8_t     *data,
                      size_t             data_size,
                      const WebPPicture *picture)
 {
-    FILE *outfile;
+    WebPAsyncWriter *outfile;
 
-    /* Obtain the FILE* and write the data to the file */
-    outfile = (FILE*)picture->custom_ptr;
-    return fwrite(data, sizeof(uint8_t), data_size, outfile) == data_size;
+    /* Obtain the writer and hand it the data */
+    outfile = (WebPAsyncWriter*)picture->custom_ptr;
+    return async_writer_write(outfile, data, data_size);
 }
 
-/* Update progress as data is written to the file */
+/* Thread the layer is being saved on, and the last progress reported by
+ * the encoder on any thread */
+GThread *progress_thread  = NULL;
+gint     progress_percent = 0;
+
+/* Update progress as data is written to the file - if a deadline was
+ * attached to the picture, encoding is aborted once it has passed.  With
+ * threading on, libwebp calls this from its worker threads too, and only
+ * the thread that started the save may talk to the GIMP */
 int webp_file_progress(int                percent,
                        const WebPPicture *picture)
 {
-    return gimp_progress_update(percent / 100.0);
+    if (!webp_deadline_progress(percent, picture)) {
+        return 0;
+    }
+
+    g_atomic_int_set(&progress_percent, percent);
+
+    if (g_thread_self() != progress_thread) {
+        return 1;
+    }
+
+    return gimp_progress_update(g_atomic_int_get(&progress_percent) / 100.0);
 }
 
-/* Convert error into a human-readable message */
-const gchar *webp_error_string(WebPEncodingError error_code)
+/* Source of the pixels read from a drawable */
+typedef struct {
+    gint          width;
+#ifdef GIMP_2_9
+    GeglBuffer   *geglbuffer;
+#else
+    GimpDrawable *drawable;
+    GimpPixelRgn  region;
+#endif
+} WebPLayerReader;
+
+/* Read a strip of rows from the drawable */
+gboolean layer_reader_strip(guchar   *buffer,
+                            gint      y,
+                            gint      nrows,
+                            gpointer  user_data)
 {
-    switch(error_code) {
-    case VP8_ENC_ERROR_OUT_OF_MEMORY:
-        return "out of memory";
-    case VP8_ENC_ERROR_BITSTREAM_OUT_OF_MEMORY:
-        return "not enough memory to flush bits";
-    case VP8_ENC_ERROR_NULL_PARAMETER:
-        return "NULL parameter";
-    case VP8_ENC_ERROR_INVALID_CONFIGURATION:
-        return "invalid configuration";
-    case VP8_ENC_ERROR_BAD_DIMENSION:
-        return "bad image dimensions";
-    case VP8_ENC_ERROR_PARTITION0_OVERFLOW:
-        return "partition is bigger than 512K";
-    case VP8_ENC_ERROR_PARTITION_OVERFLOW:
-        return "partition is bigger than 16M";
-    case VP8_ENC_ERROR_BAD_WRITE:
-        return "unable to flush bytes";
-    case VP8_ENC_ERROR_FILE_TOO_BIG:
-        return "file is larger than 4GiB";
-    case VP8_ENC_ERROR_USER_ABORT:
-        return "user aborted encoding";
-    case VP8_ENC_ERROR_LAST:
-        return "list terminator";
-    default:
-        return "unknown error";
-    }
+    WebPLayerReader *reader = (WebPLayerReader*)user_data;
+#ifdef GIMP_2_9
+    GeglRectangle    extent;
+
+    /* Read the strip into our buffer */
+    gegl_rectangle_set(&extent, 0, y, reader->width, nrows);
+    gegl_buffer_get(reader->geglbuffer, &extent, 1.0, NULL, buffer,
+                    GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+#else
+    /* Read the strip into the buffer */
+    gimp_pixel_rgn_get_rect(&reader->region,
+                            buffer,
+                            0, y,
+                            reader->width,
+                            nrows);
+#endif
+
+    return TRUE;
+}
+
+/* Read the contents of a drawable into a picture, one strip of tiles at a
+ * time so that the picture itself is the only full-size copy - opaque is
+ * set to FALSE if any pixel has transparency */
+gboolean read_layer(gint32        drawable_ID,
+                    WebPPicture  *picture,
+                    gboolean     *opaque,
+                    WebPStats    *stats,
+                    GError      **error)
+{
+    WebPLayerReader reader;
+    gboolean        status;
+    gint            height;
+
+    reader.width = gimp_drawable_width(drawable_ID);
+    height       = gimp_drawable_height(drawable_ID);
+
+#ifdef GIMP_2_9
+    /* Obtain the buffer */
+    reader.geglbuffer = gimp_drawable_get_buffer(drawable_ID);
+#else
+    /* Get the drawable */
+    reader.drawable = gimp_drawable_get(drawable_ID);
+
+    /* Obtain the pixel region for the drawable */
+    gimp_pixel_rgn_init(&reader.region,
+                        reader.drawable,
+                        0, 0,
+                        reader.width,
+                        height,
+                        FALSE, FALSE);
+#endif
+
+    /* Rows are read in strips matching the height of the tiles */
+    status = read_strips(picture,
+                         reader.width,
+                         height,
+                         gimp_drawable_bpp(drawable_ID),
+                         gimp_tile_height(),
+                         layer_reader_strip,
+                         &reader,
+                         opaque,
+                         stats,
+                         error);
+
+#ifdef GIMP_2_9
+    g_object_unref(reader.geglbuffer);
+#else
+    gimp_drawable_detach(reader.drawable);
+#endif
+
+    return status;
 }
 
 /* Save a layer from an image */
@@ -108,101 +170,46 @@ gboolean save_layer(gint32             drawable_ID,
                     int                frame_timestamp,
 #endif
                     WebPSaveParams    *params,
+                    WebPStats         *stats,
                     GError           **error)
 {
     gboolean          status   = FALSE;
-    gint              bpp;
-    gint              width;
-    gint              height;
-    GimpImageType     drawable_type;
     WebPConfig        config;
     WebPPicture       picture;
-    guchar           *buffer   = NULL;
-#ifdef GIMP_2_9
-    GeglBuffer       *geglbuffer;
-    GeglRectangle     extent;
-#else
-    GimpDrawable     *drawable = NULL;
-    GimpPixelRgn      region;
+#ifdef WEBP_0_5
+    gint64            start;
 #endif
 
-    /* Retrieve the image data */
-    bpp = gimp_drawable_bpp(drawable_ID);
-    width = gimp_drawable_width(drawable_ID);
-    height = gimp_drawable_height(drawable_ID);
-    drawable_type = gimp_drawable_type(drawable_ID);
-
-    /* Initialize the WebP configuration with a preset and fill in the
-     * remaining values */
-    WebPConfigPreset(&config,
-                     webp_preset_by_name(params->preset),
-                     params->quality);
-
-    config.lossless      = params->lossless;
-    config.method        = 6;  /* better quality */
-    config.alpha_quality = params->alpha_quality;
+    webp_config_from_params(&config, params);
 
     /* Prepare the WebP structure */
     WebPPictureInit(&picture);
-    picture.use_argb      = 1;
-    picture.width         = width;
-    picture.height        = height;
     picture.writer        = writer;
     picture.custom_ptr    = custom_ptr;
     picture.progress_hook = webp_file_progress;
 
+    progress_thread = g_thread_self();
+
     do {
-        /* Attempt to allocate a buffer of the appropriate size */
-        buffer = (guchar *)g_malloc(bpp * width * height);
-        if(!buffer) {
-            g_set_error(error,
-                        G_FILE_ERROR,
-                        0,
-                        "Unable to allocate buffer for layer");
+        /* Read the pixels from the drawable */
+        if (!read_layer(drawable_ID, &picture, NULL, stats, error)) {
             break;
         }
 
-#ifdef GIMP_2_9
-        /* Obtain the buffer and get its extent */
-        geglbuffer = gimp_drawable_get_buffer(drawable_ID);
-        extent = *gegl_buffer_get_extent(geglbuffer);
-
-        /* Read the layer buffer into our buffer */
-        gegl_buffer_get(geglbuffer, &extent, 1.0, NULL, buffer,
-                        GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
-
-        g_object_unref(geglbuffer);
-#else
-        /* Get the drawable */
-        drawable = gimp_drawable_get(drawable_ID);
-
-        /* Obtain the pixel region for the drawable */
-        gimp_pixel_rgn_init(&region,
-                            drawable,
-                            0, 0,
-                            width,
-                            height,
-                            FALSE, FALSE);
-
-        /* Read the region into the buffer */
-        gimp_pixel_rgn_get_rect(&region,
-                                buffer,
-                                0, 0,
-                                width,
-                                height);
-
-        gimp_drawable_detach(drawable);
-#endif
-
-        /* Use the appropriate function to import the data from the buffer */
-        if(drawable_type == GIMP_RGB_IMAGE) {
-            WebPPictureImportRGB(&picture, buffer, width * bpp);
-        } else {
-            WebPPictureImportRGBA(&picture, buffer, width * bpp);
-        }
-
 #ifdef WEBP_0_5
+        /* The animation encoder does not report statistics for its frames
+         * and keeps its own output, so nothing is cached */
         if (animation == TRUE) {
+            webp_config_auto(&config, &picture, params);
+
+            if (params->time_budget > 0) {
+                webp_config_fit_budget(&config,
+                                       picture.width * picture.height,
+                                       gimp_drawable_has_alpha(drawable_ID),
+                                       params->time_budget);
+            }
+
+            start = g_get_monotonic_time();
 
             if (!WebPAnimEncoderAdd(enc, &picture, frame_timestamp, &config)) {
                 g_set_error(error,
@@ -212,52 +219,386 @@ gboolean save_layer(gint32             drawable_ID,
                             webp_error_string(picture.error_code));
                 break;
             }
-        } else {
+
+            stats_add_time(stats, STATS_ENCODE, start);
+
+            status = TRUE;
+            break;
+        }
 #endif
-            if(!WebPEncode(&config, &picture)) {
+
+        /* Encode the picture, reusing an earlier export if possible */
+        status = encode_picture(&config, &picture, params,
+                                gimp_drawable_has_alpha(drawable_ID),
+                                stats, error);
+
+    } while(0);
+
+    /* Free the picture */
+    WebPPictureFree(&picture);
+
+    return status;
+}
+
+#ifdef WEBP_0_5
+/* Frames encoded ahead of the one being muxed, per worker thread */
+#define FRAMES_IN_FLIGHT_PER_THREAD 2
+
+/* Layer parasite holding the key and bitstream of the frame last exported
+ * from the layer - it is not saved with the image, so it only lasts for
+ * the session */
+#define FRAME_PARASITE "gimp-webp-frame"
+
+/* A single animation frame handed to the encoding threads */
+typedef struct {
+    WebPConfig        config;   /* own copy, the budget may change it */
+    gint              budget;   /* milliseconds, or 0 for none */
+    WebPPicture       picture;
+    WebPMemoryWriter  memory;
+    WebPAuxStats      aux_stats;
+    gint64            encode_time;
+    WebPEncodingError error_code;
+    gchar            *key;
+    gboolean          opaque;
+    gboolean          reused;   /* bitstream taken from the layer */
+    gboolean          ok;
+    gboolean          done;
+} WebPFrameJob;
+
+/* State shared between the main thread and the encoding threads */
+typedef struct {
+    GMutex mutex;
+    GCond  cond;
+} WebPFrameSync;
+
+/* Retrieve the bitstream stored with a layer by a previous export, if its
+ * key matches the layer's current pixels and parameters */
+gboolean frame_from_parasite(gint32            layer_ID,
+                             const gchar      *key,
+                             WebPMemoryWriter *memory)
+{
+    GimpParasite *parasite;
+    const gchar  *data;
+    gsize         key_size = strlen(key) + 1;
+    gsize         size;
+    gboolean      status   = FALSE;
+
+    parasite = gimp_item_get_parasite(layer_ID, FRAME_PARASITE);
+    if (!parasite) {
+        return FALSE;
+    }
+
+    data = (const gchar*)gimp_parasite_data(parasite);
+    size = gimp_parasite_data_size(parasite);
+
+    /* The key is stored first, followed by its terminator and the frame */
+    if (size > key_size && memcmp(data, key, key_size) == 0) {
+        memory->mem = (uint8_t*)malloc(size - key_size);
+        if (memory->mem) {
+            memcpy(memory->mem, data + key_size, size - key_size);
+            memory->size     = size - key_size;
+            memory->max_size = size - key_size;
+            status = TRUE;
+        }
+    }
+
+    gimp_parasite_free(parasite);
+
+    return status;
+}
+
+/* Store an encoded frame with its layer for the next export */
+void frame_to_parasite(gint32                  layer_ID,
+                       const gchar            *key,
+                       const WebPMemoryWriter *memory)
+{
+    GimpParasite *parasite;
+    gsize         key_size = strlen(key) + 1;
+    guchar       *data;
+
+    data = (guchar*)g_try_malloc(key_size + memory->size);
+    if (!data) {
+        return;
+    }
+
+    memcpy(data, key, key_size);
+    memcpy(data + key_size, memory->mem, memory->size);
+
+    parasite = gimp_parasite_new(FRAME_PARASITE, 0,
+                                 key_size + memory->size, data);
+    gimp_item_attach_parasite(layer_ID, parasite);
+
+    gimp_parasite_free(parasite);
+    g_free(data);
+}
+
+/* Encode a single frame on one of the worker threads */
+void encode_frame_job(gpointer data,
+                      gpointer user_data)
+{
+    WebPFrameJob  *job  = (WebPFrameJob*)data;
+    WebPFrameSync *sync = (WebPFrameSync*)user_data;
+    gboolean       ok;
+    gint64         start = g_get_monotonic_time();
+
+    if (job->budget > 0) {
+        ok = encode_with_budget(&job->config, &job->picture, job->budget);
+    } else {
+        ok = WebPEncode(&job->config, &job->picture);
+    }
+
+    /* The pixels are no longer needed once the frame is encoded */
+    WebPPictureFree(&job->picture);
+
+    /* Hand the result back to the main thread */
+    g_mutex_lock(&sync->mutex);
+    job->encode_time = g_get_monotonic_time() - start;
+    job->error_code  = job->picture.error_code;
+    job->ok          = ok;
+    job->done        = TRUE;
+    g_cond_broadcast(&sync->cond);
+    g_mutex_unlock(&sync->mutex);
+}
+
+/* Encode every layer as an independent keyframe across a pool of threads and
+ * write the results out in order as soon as each one is ready - layers are
+ * read on the main thread, and only a small window of frames is held in
+ * memory at any time.  Since the frames do not depend on each other, layers
+ * left unchanged since the last export reuse the frames stored with them
+ * and only retouched layers are encoded again */
+gboolean encode_frames_parallel(gint32           nLayers,
+                                gint32          *allLayers,
+                                WebPAsyncWriter *outfile,
+                                WebPSaveParams  *params,
+                                WebPStats       *stats,
+                                GError         **error)
+{
+    gboolean       status       = TRUE;
+    WebPSaveParams frame_params = *params;
+    WebPConfig     config;
+    WebPFrameJob  *jobs;
+    WebPFrameSync  sync;
+    GThreadPool   *pool;
+    WebPAnimStream stream;
+    gint           nthreads;
+    gint           window;
+    gint           next_read = 0;
+    gint           width;
+    gint           height;
+    gint           i;
+    gint64         start;
+    gint64         frame_memory;
+
+    webp_config_from_params(&config, params);
+
+    /* Frames are encoded concurrently - libwebp's own threads would only
+     * compete with them */
+    config.thread_level = 0;
+
+    width  = gimp_drawable_width(allLayers[0]);
+    height = gimp_drawable_height(allLayers[0]);
+
+    nthreads = MAX(g_get_num_processors(), 1);
+    window   = nthreads * FRAMES_IN_FLIGHT_PER_THREAD;
+
+    /* Hold no more frames than fit within the memory budget - the budget
+     * was checked to allow at least one */
+    frame_memory = webp_encode_memory(&config, width, height,
+                                      gimp_drawable_has_alpha(allLayers[0]));
+    window   = (gint)MAX(MIN(window, webp_memory_budget_bytes(params->memory_budget) /
+                                     MAX(frame_memory, 1)), 1);
+    nthreads = MIN(nthreads, window);
+
+    /* Share the time budget between the frames, which are encoded
+     * nthreads at a time */
+    if (params->time_budget > 0) {
+        frame_params.time_budget = MAX(params->time_budget * nthreads / nLayers, 1);
+        webp_config_fit_budget(&config,
+                               width * height,
+                               gimp_drawable_has_alpha(allLayers[0]),
+                               frame_params.time_budget);
+    }
+
+    start = g_get_monotonic_time();
+    if (!anim_stream_begin(&stream, outfile, width, height, params->loop,
+                           error)) {
+        return FALSE;
+    }
+    stats_add_time(stats, STATS_MUX, start);
+
+    jobs = g_new0(WebPFrameJob, nLayers);
+
+    g_mutex_init(&sync.mutex);
+    g_cond_init(&sync.cond);
+
+    pool = g_thread_pool_new(encode_frame_job, &sync, nthreads, FALSE, NULL);
+
+    for (i = 0; i < nLayers && status == TRUE; ++i) {
+
+        /* Read layers until the window is full */
+        while (next_read < nLayers && next_read < i + window) {
+            WebPFrameJob *job = &jobs[next_read];
+
+            WebPPictureInit(&job->picture);
+            WebPMemoryWriterInit(&job->memory);
+            job->picture.writer        = WebPMemoryWrite;
+            job->picture.custom_ptr    = &job->memory;
+            job->picture.stats         = stats ? &job->aux_stats : NULL;
+            job->picture.progress_hook = webp_deadline_progress;
+
+            if (gimp_drawable_width(allLayers[next_read]) != width ||
+                    gimp_drawable_height(allLayers[next_read]) != height) {
                 g_set_error(error,
                             G_FILE_ERROR,
-                            picture.error_code,
-                            "WebP error: '%s'",
-                            webp_error_string(picture.error_code));
+                            0,
+                            "All layers must be the same size as the first");
+                status = FALSE;
                 break;
             }
-#ifdef WEBP_0_5
+
+            if (!read_layer(allLayers[next_read], &job->picture,
+                            &job->opaque, stats, error)) {
+                status = FALSE;
+                break;
+            }
+
+            /* The "auto" preset picks the settings for every frame from
+             * the content of the first one */
+            if (next_read == 0 &&
+                    webp_config_auto(&config, &job->picture, params) &&
+                    params->time_budget > 0) {
+                webp_config_fit_budget(&config,
+                                       width * height,
+                                       gimp_drawable_has_alpha(allLayers[0]),
+                                       frame_params.time_budget);
+            }
+
+            /* Each frame gets its share of the time budget as a deadline,
+             * after which it is encoded again with the fastest method */
+            job->config = config;
+            job->budget = frame_params.time_budget;
+
+            /* Skip encoding layers whose pixels have not changed - the key
+             * covers the settings resolved from the first frame, so frames
+             * stored under other settings are encoded again */
+            job->key = cache_key(&job->picture, &config, &frame_params);
+
+            if (frame_from_parasite(allLayers[next_read], job->key,
+                                    &job->memory)) {
+                WebPPictureFree(&job->picture);
+                job->reused = TRUE;
+                job->ok     = TRUE;
+                job->done   = TRUE;
+            } else {
+                g_thread_pool_push(pool, job, NULL);
+            }
+
+            ++next_read;
         }
-#endif
 
-        /* Everything succeeded */
-        status = TRUE;
+        if (status == FALSE) {
+            break;
+        }
 
-    } while(0);
+        /* Wait for the next frame in order */
+        g_mutex_lock(&sync.mutex);
+        while (!jobs[i].done) {
+            g_cond_wait(&sync.cond, &sync.mutex);
+        }
+        g_mutex_unlock(&sync.mutex);
+
+        if (!jobs[i].ok) {
+            g_set_error(error,
+                        G_FILE_ERROR,
+                        jobs[i].error_code,
+                        "WebP error: '%s'",
+                        webp_error_string(jobs[i].error_code));
+            status = FALSE;
+            break;
+        }
 
-    /* Free the buffer */
-    if (buffer) {
-        free(buffer);
+        if (stats && !jobs[i].reused) {
+            stats->time[STATS_ENCODE] += jobs[i].encode_time;
+            stats_add_aux(stats, &jobs[i].aux_stats);
+        }
+
+        /* Frames that ran out of time were encoded with the fastest
+         * method instead, so they are not kept for the next export */
+        if (!jobs[i].reused && jobs[i].config.method == config.method) {
+            frame_to_parasite(allLayers[i], jobs[i].key, &jobs[i].memory);
+        }
+
+        /* Write the frame out and release it */
+        start = g_get_monotonic_time();
+        if (!anim_stream_add_frame(&stream,
+                                   jobs[i].memory.mem,
+                                   jobs[i].memory.size,
+                                   width, height,
+                                   FRAME_DURATION,
+                                   !jobs[i].opaque,
+                                   error)) {
+            status = FALSE;
+        }
+        stats_add_time(stats, STATS_MUX, start);
+
+        WebPMemoryWriterClear(&jobs[i].memory);
+
+        gimp_progress_update((gdouble)(i + 1) / nLayers);
+    }
+
+    /* Wait for any frames still being encoded before freeing them */
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    for (i = 0; i < nLayers; ++i) {
+        WebPPictureFree(&jobs[i].picture);
+        WebPMemoryWriterClear(&jobs[i].memory);
+        g_free(jobs[i].key);
+    }
+
+    g_cond_clear(&sync.cond);
+    g_mutex_clear(&sync.mutex);
+    g_free(jobs);
+
+    if (status == TRUE) {
+        start  = g_get_monotonic_time();
+        status = anim_stream_end(&stream, error);
+        stats_add_time(stats, STATS_MUX, start);
     }
 
     return status;
 }
 
-#ifdef WEBP_0_5
 /* Save an animation to disk */
-gboolean save_animation(gint32          nLayers,
-                        gint32         *allLayers,
-                        FILE           *outfile,
-                        WebPSaveParams *params,
-                        GError        **error)
+gboolean save_animation(gint32           nLayers,
+                        gint32          *allLayers,
+                        WebPAsyncWriter *outfile,
+                        WebPSaveParams  *params,
+                        WebPStats       *stats,
+                        GError         **error)
 {
     gboolean               status          = FALSE;
     gboolean               innerStatus     = TRUE;
+    WebPSaveParams         frame_params    = *params;
     WebPAnimEncoderOptions enc_options;
     WebPAnimEncoder       *enc             = NULL;
     int                    frame_timestamp = 0;
     WebPData               webp_data       = {0};
-    WebPMux               *mux;
-    WebPMuxAnimParams      anim_params     = {0};
+    gint64                 start;
+
+    /* Independent frames are written out as they are encoded */
+    if (params->anim_parallel == TRUE) {
+        return encode_frames_parallel(nLayers, allLayers, outfile, params,
+                                      stats, error);
+    }
+
+    /* Each frame gets an equal share of the time budget */
+    if (params->time_budget > 0) {
+        frame_params.time_budget = MAX(params->time_budget / nLayers, 1);
+    }
 
     /* Prepare for encoding an animation */
     WebPAnimEncoderOptionsInit(&enc_options);
+    enc_options.anim_params.loop_count = params->loop == TRUE ? 0 : 1;
 
     do {
         int i;
@@ -276,10 +617,13 @@ gboolean save_animation(gint32          nLayers,
                                           TRUE,
                                           enc,
                                           frame_timestamp,
-                                          params,
+                                          &frame_params,
+                                          stats,
                                           error)) == FALSE) {
                 break;
             }
+
+            frame_timestamp += FRAME_DURATION;
         }
 
         /* Check to make sure each layer was encoded correctly */
@@ -288,12 +632,14 @@ gboolean save_animation(gint32          nLayers,
         }
 
         /* Add NULL frame */
+        start = g_get_monotonic_time();
         WebPAnimEncoderAdd(enc, NULL, frame_timestamp, NULL);
 
         /* Initialize the WebP image structure */
         WebPDataInit(&webp_data);
 
-        /* Write the animation to the image */
+        /* Write the animation to the image - the loop count was already
+         * supplied to the encoder, so it can go straight to disk */
         if (!WebPAnimEncoderAssemble(enc, &webp_data)) {
             g_set_error(error,
                         G_FILE_ERROR,
@@ -303,21 +649,14 @@ gboolean save_animation(gint32          nLayers,
             break;
         }
 
-        /* Create a Mux */
-        mux = WebPMuxCreate(&webp_data, 1);
-
-        /* Set animation parameters */
-        anim_params.loop_count = params->loop == TRUE ? 0 : 1;
-        WebPMuxSetAnimationParams(mux, &anim_params);
-
-        /* Assemble the image */
-        WebPMuxAssemble(mux, &webp_data);
-
         /* Write to disk */
-        if (fwrite(webp_data.bytes, webp_data.size, 1, outfile) != 1) {
+        if (!async_writer_write(outfile, webp_data.bytes, webp_data.size)) {
+            async_writer_set_error(outfile, error);
             break;
         }
 
+        stats_add_time(stats, STATS_MUX, start);
+
         /* Everything succeeded */
         status = TRUE;
 
@@ -335,6 +674,326 @@ gboolean save_animation(gint32          nLayers,
 }
 #endif
 
+/* Items read ahead of the encoders in a batch, per worker thread */
+#define BATCH_ITEMS_PER_THREAD 2
+
+/* A single item of a batch handed to the encoding threads */
+typedef struct {
+    WebPConfig        config;
+    WebPPicture       picture;
+    WebPSaveParams    params;   /* without trials if they do not fit */
+    gboolean          alpha;
+    const gchar      *filename;
+    gint64            start;
+    gint64            memory;   /* estimated bytes needed */
+    gint32           *status;
+    gdouble          *time;
+} WebPBatchJob;
+
+/* State shared between the main thread and the encoding threads */
+typedef struct {
+    GMutex mutex;
+    GCond  cond;
+    gint   completed;
+    gint64 in_flight;   /* estimated bytes used by items being encoded */
+} WebPBatchSync;
+
+/* Encode a single item and write it to disk on one of the worker threads */
+void encode_batch_job(gpointer data,
+                      gpointer user_data)
+{
+    WebPBatchJob     *job  = (WebPBatchJob*)data;
+    WebPBatchSync    *sync = (WebPBatchSync*)user_data;
+    WebPMemoryWriter  memory;
+    gboolean          ok;
+
+    WebPMemoryWriterInit(&memory);
+    job->picture.writer     = WebPMemoryWrite;
+    job->picture.custom_ptr = &memory;
+
+    /* Encode the item as save_layer() does */
+    ok = encode_picture(&job->config, &job->picture, &job->params,
+                        job->alpha, NULL, NULL);
+    WebPPictureFree(&job->picture);
+
+    /* g_file_set_contents() replaces the file atomically */
+    if (ok) {
+        ok = g_file_set_contents(job->filename,
+                                 (const gchar*)memory.mem,
+                                 memory.size,
+                                 NULL);
+    }
+
+    WebPMemoryWriterClear(&memory);
+
+    *job->status = ok ? GIMP_PDB_SUCCESS : GIMP_PDB_EXECUTION_ERROR;
+    *job->time   = (g_get_monotonic_time() - job->start) / 1000.0;
+
+    g_mutex_lock(&sync->mutex);
+    ++sync->completed;
+    sync->in_flight -= job->memory;
+    g_cond_broadcast(&sync->cond);
+    g_mutex_unlock(&sync->mutex);
+
+    g_free(job);
+}
+
+/* Save a list of RGB(A) drawables to their own files with shared
+ * parameters - pixels are read on the main thread while earlier items are
+ * encoded across a pool of threads, and the status and time taken (in ms)
+ * of each item is recorded.  Items that failed are named in the error,
+ * which is set even if others were saved - FALSE is only returned when no
+ * item was saved */
+gboolean save_batch(gint            nitems,
+                    const gint32   *drawable_IDs,
+                    gchar         **filenames,
+                    WebPSaveParams *params,
+                    gint32         *statuses,
+                    gdouble        *times,
+                    GError        **error)
+{
+    gboolean       status = FALSE;
+    WebPConfig     config;
+    WebPBatchSync  sync;
+    GThreadPool   *pool;
+    gint           nthreads;
+    gint           window;
+    gint           pushed = 0;
+    gint           i;
+    gint64         budget;
+    GString       *failed;
+
+#ifdef GIMP_2_9
+    /* Initialize GEGL */
+    gegl_init(NULL, NULL);
+#endif
+
+    webp_config_from_params(&config, params);
+
+    /* Items are encoded concurrently - libwebp's own threads would only
+     * compete with them */
+    config.thread_level = 0;
+
+    nthreads = MAX(g_get_num_processors(), 1);
+    window   = nthreads * BATCH_ITEMS_PER_THREAD;
+
+    budget = webp_memory_budget_bytes(params->memory_budget);
+
+    g_mutex_init(&sync.mutex);
+    g_cond_init(&sync.cond);
+    sync.completed = 0;
+    sync.in_flight = 0;
+
+    pool = g_thread_pool_new(encode_batch_job, &sync, nthreads, FALSE, NULL);
+
+    for (i = 0; i < nitems; ++i) {
+        WebPBatchJob *job;
+        gint64        memory;
+        gboolean      trials = params->trials;
+        gint          width  = gimp_drawable_width(drawable_IDs[i]);
+        gint          height = gimp_drawable_height(drawable_IDs[i]);
+        gboolean      alpha  = gimp_drawable_has_alpha(drawable_IDs[i]);
+
+        memory = webp_encode_memory(&config, width, height, alpha);
+
+        /* Fall back to a single encoding if the trials do not fit */
+        if (trials) {
+            gint64 trials_memory = webp_trials_memory(&config, width, height,
+                                                      alpha);
+
+            if (trials_memory <= budget) {
+                memory = trials_memory;
+            } else {
+                trials = FALSE;
+            }
+        }
+
+        /* Items that can never fit are failed before anything is read */
+        if (memory > budget) {
+            statuses[i] = GIMP_PDB_EXECUTION_ERROR;
+            times[i]    = 0.0;
+            continue;
+        }
+
+        /* Limit the number of pictures held in memory */
+        g_mutex_lock(&sync.mutex);
+        while (pushed - sync.completed >= window ||
+                sync.in_flight > budget - memory) {
+            g_cond_wait(&sync.cond, &sync.mutex);
+        }
+        sync.in_flight += memory;
+        g_mutex_unlock(&sync.mutex);
+
+        job = g_new0(WebPBatchJob, 1);
+        job->config        = config;
+        job->params        = *params;
+        job->params.trials = trials;
+        job->alpha         = alpha;
+        job->filename      = filenames[i];
+        job->start    = g_get_monotonic_time();
+        job->memory   = memory;
+        job->status   = &statuses[i];
+        job->time     = &times[i];
+
+        WebPPictureInit(&job->picture);
+
+        if (!read_layer(drawable_IDs[i], &job->picture, NULL, NULL, NULL)) {
+            g_mutex_lock(&sync.mutex);
+            sync.in_flight -= memory;
+            g_mutex_unlock(&sync.mutex);
+
+            WebPPictureFree(&job->picture);
+            g_free(job);
+            statuses[i] = GIMP_PDB_EXECUTION_ERROR;
+            times[i]    = 0.0;
+            continue;
+        }
+
+        g_thread_pool_push(pool, job, NULL);
+        ++pushed;
+
+        gimp_progress_update((gdouble)(i + 1) / nitems);
+    }
+
+    /* Wait for every item to finish */
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    g_cond_clear(&sync.cond);
+    g_mutex_clear(&sync.mutex);
+
+    /* Name every item that failed in the error */
+    failed = g_string_new(NULL);
+
+    for (i = 0; i < nitems; ++i) {
+        if (statuses[i] != GIMP_PDB_SUCCESS) {
+            gchar *display_name = g_filename_display_name(filenames[i]);
+
+            g_string_append_printf(failed, "%s'%s'",
+                                   failed->len ? ", " : "", display_name);
+            g_free(display_name);
+        } else {
+            status = TRUE;
+        }
+    }
+
+    if (failed->len) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    0,
+                    "Unable to save %s",
+                    failed->str);
+    }
+
+    g_string_free(failed, TRUE);
+
+    return status;
+}
+
+#ifdef WEBP_0_5
+/* Canvas-sized buffers kept by the animation encoder while it looks for the
+ * best way to code each frame */
+#define ANIM_ENCODER_CANVASES 6
+
+/* Approximate size of each encoded frame held by the animation encoder until
+ * the animation is assembled, in bytes per pixel */
+#define ANIM_LOSSY_FRAME_BYTES_PER_PIXEL    1
+#define ANIM_LOSSLESS_FRAME_BYTES_PER_PIXEL 3
+#endif
+
+/* Check that an export fits within the memory budget before anything is
+ * allocated - animations that would not fit inside the animation encoder
+ * are streamed as independent frames instead, which holds only as many
+ * frames as the budget allows */
+gboolean fit_memory_budget(
+#ifdef WEBP_0_5
+                           gint32          nLayers,
+                           gint32         *allLayers,
+#endif
+                           gint32          drawable_ID,
+                           WebPSaveParams *params,
+                           GError        **error)
+{
+    WebPConfig config;
+    gint64     budget;
+    gint64     needed;
+    gint       width;
+    gint       height;
+
+    if (params->memory_budget <= 0) {
+        return TRUE;
+    }
+
+    budget = webp_memory_budget_bytes(params->memory_budget);
+    webp_config_from_params(&config, params);
+
+#ifdef WEBP_0_5
+    if (params->animation == TRUE) {
+        drawable_ID = allLayers[0];
+    }
+#endif
+
+    width  = gimp_drawable_width(drawable_ID);
+    height = gimp_drawable_height(drawable_ID);
+
+    /* At least one frame has to be encoded at a time in any case */
+    needed = webp_encode_memory(&config, width, height,
+                                gimp_drawable_has_alpha(drawable_ID));
+
+    /* Fall back to a single encoding if the trials do not all fit */
+    if (params->trials == TRUE &&
+#ifdef WEBP_0_5
+            params->animation == FALSE &&
+#endif
+            webp_trials_memory(&config, width, height,
+                               gimp_drawable_has_alpha(drawable_ID)) > budget) {
+        params->trials = FALSE;
+    }
+
+#ifdef WEBP_0_5
+    if (params->animation == TRUE && params->anim_parallel == FALSE &&
+            needed <= budget) {
+        gint64 pixels = (gint64)width * height;
+        gint64 anim_needed;
+        gint   i;
+
+        anim_needed = needed + pixels * 4 * ANIM_ENCODER_CANVASES +
+                pixels * nLayers * (config.lossless ?
+                                    ANIM_LOSSLESS_FRAME_BYTES_PER_PIXEL :
+                                    ANIM_LOSSY_FRAME_BYTES_PER_PIXEL);
+
+        if (anim_needed > budget) {
+
+            /* Independent frames must all be the size of the canvas */
+            for (i = 0; i < nLayers; ++i) {
+                if (gimp_drawable_width(allLayers[i]) != width ||
+                        gimp_drawable_height(allLayers[i]) != height) {
+                    break;
+                }
+            }
+
+            if (i == nLayers) {
+                params->anim_parallel = TRUE;
+            } else {
+                needed = anim_needed;
+            }
+        }
+    }
+#endif
+
+    if (needed > budget) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    0,
+                    "Exporting needs about %d MiB of memory, which exceeds "
+                    "the memory budget of %d MiB",
+                    (gint)(needed / (1024 * 1024)) + 1,
+                    params->memory_budget);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 /* Save a WebP image to disk */
 gboolean save_image(const gchar    *filename,
 #ifdef WEBP_0_5
@@ -343,36 +1002,63 @@ gboolean save_image(const gchar    *filename,
 #endif
                     gint32          drawable_ID,
                     WebPSaveParams *params,
+                    WebPSaveStats  *stats,
                     GError        **error)
 {
-    gboolean status  = FALSE;
-    FILE    *outfile = NULL;
+    gboolean         status  = FALSE;
+    WebPAsyncWriter *outfile = NULL;
+    WebPSaveParams   budget_params = *params;
+    WebPSaveStats    log_stats;
+    WebPStatsPhase   phase   = STATS_ENCODE;
+    gint64           wait_time;
+    gint64           start;
+
+    /* Statistics are always gathered when they are going to be logged */
+    if (!stats && stats_log_enabled()) {
+        stats = &log_stats;
+    }
+
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+    }
 
 #ifdef GIMP_2_9
     /* Initialize GEGL */
     gegl_init(NULL, NULL);
 #endif
 
+    /* Fail before creating any files if the export would not fit in memory -
+     * this may change how animations are encoded */
+    params = &budget_params;
+    if (!fit_memory_budget(
+#ifdef WEBP_0_5
+                           nLayers,
+                           allLayers,
+#endif
+                           drawable_ID,
+                           params,
+                           error)) {
+        return FALSE;
+    }
+
     /* Begin displaying export progress */
     gimp_progress_init_printf("Saving '%s'",
                               gimp_filename_to_utf8(filename));
 
-    /* Attempt to open the output file */
-    if((outfile = g_fopen(filename, "wb+")) == NULL) {
-        g_set_error(error,
-                    G_FILE_ERROR,
-                    g_file_error_from_errno(errno),
-                    "Unable to open '%s' for writing",
-                    gimp_filename_to_utf8(filename));
+    /* Attempt to open the output file - the data is written to a temporary
+     * file by a separate thread and only replaces the target at the end */
+    if((outfile = async_writer_open(filename, error)) == NULL) {
         return FALSE;
     }
 
 #ifdef WEBP_0_5
     if (params->animation == TRUE) {
+        phase  = STATS_MUX;
         status = save_animation(nLayers,
                                 allLayers,
                                 outfile,
                                 params,
+                                stats ? &stats->stats : NULL,
                                 error);
     } else {
 #endif
@@ -385,14 +1071,46 @@ gboolean save_image(const gchar    *filename,
                             0,
 #endif
                             params,
+                            stats ? &stats->stats : NULL,
                             error);
 #ifdef WEBP_0_5
     }
 #endif
 
-    /* Close the file */
-    if(outfile) {
-        fclose(outfile);
+    /* Time spent blocked on the writer belongs to writing rather than to
+     * the phase handing it data */
+    wait_time = async_writer_get_wait_time(outfile);
+
+    if (stats) {
+        WebPConfig config;
+
+        /* libwebp does not report how many passes it actually ran */
+        webp_config_from_params(&config, params);
+
+        stats->file_size = async_writer_get_size(outfile);
+        stats->passes    = config.pass;
+        stats->stats.frames = 1;
+#ifdef WEBP_0_5
+        if (params->animation == TRUE) {
+            stats->stats.frames = nLayers;
+        }
+#endif
+        stats->stats.time[phase]       -= wait_time;
+        stats->stats.time[STATS_WRITE] += wait_time;
+    }
+
+    /* Close the file, keeping it only if everything succeeded */
+    start = g_get_monotonic_time();
+    if(!async_writer_close(outfile, status, status ? error : NULL)) {
+        status = FALSE;
+    }
+
+    if (stats) {
+        stats_add_time(&stats->stats, STATS_WRITE, start);
+
+        if (status) {
+            stats_log("save", filename, stats->file_size, &stats->stats);
+        }
     }
 
     return status;
@@ -22,17 +22,14 @@
 #include <glib.h>
 
 #include "config.h"
+#include "webp-codec.h"
+#include "webp-stats.h"
 
 typedef struct {
-    gchar   *preset;
-    gboolean lossless;
-    gfloat   quality;
-    gfloat   alpha_quality;
-#ifdef WEBP_0_5
-    gboolean animation;
-    gboolean loop;
-#endif
-} WebPSaveParams;
+    gint      file_size;
+    gint      passes;     /* passes allowed for a target size or PSNR */
+    WebPStats stats;
+} WebPSaveStats;
 
 gboolean save_image(const gchar    *filename,
 #ifdef WEBP_0_5
@@ -41,6 +38,15 @@ gboolean save_image(const gchar    *filename,
 #endif
                     gint32          drawable_ID,
                     WebPSaveParams *params,
+                    WebPSaveStats  *stats,
+                    GError        **error);
+
+gboolean save_batch(gint            nitems,
+                    const gint32   *drawable_IDs,
+                    gchar         **filenames,
+                    WebPSaveParams *params,
+                    gint32         *statuses,
+                    gdouble        *times,
                     GError        **error);
 
 #endif /* __WEBP_SAVE_H__ */
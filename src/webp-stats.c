@@ -0,0 +1,227 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "webp-stats.h"
+
+/* Name of the environment variable holding the path of the log file */
+#define STATS_LOG_VARIABLE "GIMP_WEBP_STATS_LOG"
+
+const gchar *phase_names[STATS_PHASE_COUNT] = {
+    "read", "import", "encode", "mux", "write", "demux", "decode", "layer"
+};
+
+/* Add the time elapsed since start to a phase - stats may be NULL */
+void stats_add_time(WebPStats      *stats,
+                    WebPStatsPhase  phase,
+                    gint64          start)
+{
+    if (stats) {
+        stats->time[phase] += g_get_monotonic_time() - start;
+    }
+}
+
+/* Accumulate the encoder statistics of a single frame */
+void stats_add_aux(WebPStats          *stats,
+                   const WebPAuxStats *aux)
+{
+    gint i;
+
+    if (!stats) {
+        return;
+    }
+
+    stats->aux.coded_size      += aux->coded_size;
+    stats->aux.alpha_data_size += aux->alpha_data_size;
+    stats->aux.layer_data_size += aux->layer_data_size;
+
+    for (i = 0; i < 5; ++i) {
+        stats->aux.PSNR[i] += aux->PSNR[i];
+    }
+    for (i = 0; i < 3; ++i) {
+        stats->aux.block_count[i] += aux->block_count[i];
+    }
+    for (i = 0; i < 2; ++i) {
+        stats->aux.header_bytes[i] += aux->header_bytes[i];
+    }
+    for (i = 0; i < 4; ++i) {
+        stats->aux.segment_size[i] += aux->segment_size[i];
+    }
+
+    ++stats->aux_count;
+}
+
+/* Retrieve the time spent in a phase in milliseconds */
+gdouble stats_time_ms(const WebPStats *stats,
+                      WebPStatsPhase   phase)
+{
+    return stats->time[phase] / 1000.0;
+}
+
+/* Retrieve the overall PSNR averaged over the frames with statistics */
+gfloat stats_psnr(const WebPStats *stats)
+{
+    return stats->aux_count ? stats->aux.PSNR[3] / stats->aux_count : 0.0f;
+}
+
+/* Append a number without depending on the locale's decimal separator */
+void json_append_double(GString *json,
+                        gdouble  value)
+{
+    gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+    g_string_append(json, g_ascii_formatd(buffer, sizeof(buffer), "%.3f", value));
+}
+
+/* Append a quoted string, escaping the characters JSON requires */
+void json_append_string(GString     *json,
+                        const gchar *value)
+{
+    g_string_append_c(json, '"');
+
+    for (; *value; ++value) {
+        if (*value == '"' || *value == '\\') {
+            g_string_append_c(json, '\\');
+            g_string_append_c(json, *value);
+        } else if ((guchar)*value < 0x20) {
+            g_string_append_printf(json, "\\u%04x", (guchar)*value);
+        } else {
+            g_string_append_c(json, *value);
+        }
+    }
+
+    g_string_append_c(json, '"');
+}
+
+void json_append_ints(GString   *json,
+                      const int *values,
+                      gint       count)
+{
+    gint i;
+
+    g_string_append_c(json, '[');
+    for (i = 0; i < count; ++i) {
+        g_string_append_printf(json, i ? ", %d" : "%d", values[i]);
+    }
+    g_string_append_c(json, ']');
+}
+
+/* Describe an operation as a single-line JSON object */
+gchar *stats_to_json(const gchar     *operation,
+                     const gchar     *filename,
+                     gint64           file_size,
+                     const WebPStats *stats)
+{
+    GString *json = g_string_new("{\"operation\": ");
+    gchar   *display_name;
+    gint     i;
+
+    json_append_string(json, operation);
+
+    if (filename) {
+        display_name = g_filename_display_name(filename);
+        g_string_append(json, ", \"file\": ");
+        json_append_string(json, display_name);
+        g_free(display_name);
+    }
+
+    /* The size is left out when it is not known */
+    if (file_size >= 0) {
+        g_string_append_printf(json, ", \"file_size\": %" G_GINT64_FORMAT,
+                               file_size);
+    }
+
+    g_string_append_printf(json, ", \"frames\": %d, \"time_ms\": {",
+                           stats->frames);
+
+    for (i = 0; i < STATS_PHASE_COUNT; ++i) {
+        g_string_append_printf(json, i ? ", \"%s\": " : "\"%s\": ",
+                               phase_names[i]);
+        json_append_double(json, stats_time_ms(stats, i));
+    }
+
+    g_string_append_c(json, '}');
+
+    /* Sizes are totals over the frames, PSNR values are averages */
+    if (stats->aux_count) {
+        g_string_append_printf(json,
+                               ", \"encoder\": {\"frames\": %d, \"psnr\": [",
+                               stats->aux_count);
+        for (i = 0; i < 5; ++i) {
+            if (i) {
+                g_string_append(json, ", ");
+            }
+            json_append_double(json, stats->aux.PSNR[i] / stats->aux_count);
+        }
+
+        g_string_append_printf(json,
+                               "], \"coded_size\": %d, \"alpha_data_size\": %d"
+                               ", \"layer_data_size\": %d, \"header_bytes\": ",
+                               stats->aux.coded_size,
+                               stats->aux.alpha_data_size,
+                               stats->aux.layer_data_size);
+        json_append_ints(json, stats->aux.header_bytes, 2);
+        g_string_append(json, ", \"segment_size\": ");
+        json_append_ints(json, stats->aux.segment_size, 4);
+        g_string_append(json, ", \"block_count\": ");
+        json_append_ints(json, stats->aux.block_count, 3);
+        g_string_append_c(json, '}');
+    }
+
+    g_string_append_c(json, '}');
+
+    return g_string_free(json, FALSE);
+}
+
+/* Determine whether operations should be logged */
+gboolean stats_log_enabled(void)
+{
+    const gchar *path = g_getenv(STATS_LOG_VARIABLE);
+
+    return path && *path;
+}
+
+/* Append an operation to the log file named by the environment variable, if
+ * it is set - each operation is written as a single line */
+void stats_log(const gchar     *operation,
+               const gchar     *filename,
+               gint64           file_size,
+               const WebPStats *stats)
+{
+    FILE  *file;
+    gchar *json;
+
+    if (!stats_log_enabled()) {
+        return;
+    }
+
+    file = fopen(g_getenv(STATS_LOG_VARIABLE), "a");
+    if (!file) {
+        g_warning("Unable to open %s for appending", STATS_LOG_VARIABLE);
+        return;
+    }
+
+    json = stats_to_json(operation, filename, file_size, stats);
+    fprintf(file, "%s\n", json);
+    fclose(file);
+
+    g_free(json);
+}
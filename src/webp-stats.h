@@ -0,0 +1,75 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WEBP_STATS_H__
+#define __WEBP_STATS_H__
+
+#include <glib.h>
+#include <webp/encode.h>
+
+/* Phases of loading and saving that are timed separately */
+typedef enum {
+    STATS_READ,     /* pixel transfer from the GIMP */
+    STATS_IMPORT,   /* conversion to the encoder's ARGB format */
+    STATS_ENCODE,
+    STATS_MUX,
+    STATS_WRITE,    /* waiting on the writer, flushing and renaming */
+    STATS_DEMUX,
+    STATS_DECODE,
+    STATS_LAYER,    /* pixel transfer to the GIMP */
+    STATS_PHASE_COUNT
+} WebPStatsPhase;
+
+/* Time spent in each phase (in microseconds) along with the encoder's own
+ * statistics - work done on worker threads is summed, so the total can
+ * exceed the time that actually elapsed */
+typedef struct {
+    gint64       time[STATS_PHASE_COUNT];
+    gint         frames;
+    gint         aux_count;   /* frames with encoder statistics */
+    WebPAuxStats aux;         /* sizes and PSNR summed over those frames */
+} WebPStats;
+
+void stats_add_time(WebPStats      *stats,
+                    WebPStatsPhase  phase,
+                    gint64          start);
+
+void stats_add_aux(WebPStats          *stats,
+                   const WebPAuxStats *aux);
+
+gdouble stats_time_ms(const WebPStats *stats,
+                      WebPStatsPhase   phase);
+
+gfloat stats_psnr(const WebPStats *stats);
+
+void json_append_string(GString     *json,
+                        const gchar *value);
+
+gchar *stats_to_json(const gchar     *operation,
+                     const gchar     *filename,
+                     gint64           file_size,
+                     const WebPStats *stats);
+
+gboolean stats_log_enabled(void);
+
+void stats_log(const gchar     *operation,
+               const gchar     *filename,
+               gint64           file_size,
+               const WebPStats *stats);
+
+#endif /* __WEBP_STATS_H__ */
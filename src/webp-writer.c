@@ -0,0 +1,422 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef G_OS_WIN32
+#  include <io.h>
+#  include <windows.h>
+#  define fsync _commit
+#else
+#  include <stdlib.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#include "webp-writer.h"
+
+#ifndef O_BINARY
+#  define O_BINARY 0
+#endif
+
+/* Size of each of the two buffers - one is filled by the encoder while the
+ * writer thread flushes the other */
+#define ASYNC_WRITER_BUFFER_SIZE (1024 * 1024)
+
+struct _WebPAsyncWriter {
+    gchar   *filename;
+    gchar   *display_name;  /* UTF-8 version of the filename for messages */
+    gchar   *tmp_filename;
+    FILE    *file;
+    GThread *thread;
+    GMutex   mutex;
+    GCond    cond;
+    guint8  *buffers[2];
+    gint     current;       /* buffer being filled by the encoder */
+    gsize    fill;
+    gint     pending;       /* buffer queued for the thread, or -1 */
+    gsize    pending_size;
+    gboolean finish;
+    gint     errsv;         /* errno of the first failed write */
+    gsize    total;
+    gint64   wait_time;     /* microseconds spent waiting for the thread */
+};
+
+/* Write each buffer handed over by the encoder to disk */
+gpointer async_writer_thread(gpointer data)
+{
+    WebPAsyncWriter *writer = (WebPAsyncWriter*)data;
+    gint             index;
+    gsize            size;
+    gboolean         ok;
+    gint             errsv;
+
+    g_mutex_lock(&writer->mutex);
+
+    for (;;) {
+        while (writer->pending < 0 && !writer->finish) {
+            g_cond_wait(&writer->cond, &writer->mutex);
+        }
+
+        /* Only stop once everything queued has been written */
+        if (writer->pending < 0) {
+            break;
+        }
+
+        index = writer->pending;
+        size  = writer->pending_size;
+
+        /* Let the encoder keep filling the other buffer meanwhile */
+        g_mutex_unlock(&writer->mutex);
+        errno = 0;
+        ok    = fwrite(writer->buffers[index], 1, size, writer->file) == size;
+        errsv = errno;
+        g_mutex_lock(&writer->mutex);
+
+        if (!ok && !writer->errsv) {
+            writer->errsv = errsv ? errsv : EIO;
+        }
+
+        writer->pending = -1;
+        g_cond_broadcast(&writer->cond);
+    }
+
+    g_mutex_unlock(&writer->mutex);
+
+    return NULL;
+}
+
+/* Hand the buffer being filled over to the writer thread */
+gboolean async_writer_flush(WebPAsyncWriter *writer)
+{
+    gboolean ok;
+    gint64   start = g_get_monotonic_time();
+
+    g_mutex_lock(&writer->mutex);
+
+    /* Wait for the thread to finish with the other buffer */
+    while (writer->pending >= 0) {
+        g_cond_wait(&writer->cond, &writer->mutex);
+    }
+
+    writer->wait_time += g_get_monotonic_time() - start;
+
+    ok = !writer->errsv;
+    if (ok) {
+        writer->pending      = writer->current;
+        writer->pending_size = writer->fill;
+        g_cond_broadcast(&writer->cond);
+    }
+
+    g_mutex_unlock(&writer->mutex);
+
+    writer->current ^= 1;
+    writer->fill     = 0;
+
+    return ok;
+}
+
+/* Resolve the file that will actually be replaced - renaming over a
+ * symlink would replace the link rather than the file it points to */
+gchar *async_writer_resolve(const gchar *filename)
+{
+#ifndef G_OS_WIN32
+    char *resolved = realpath(filename, NULL);
+
+    if (resolved) {
+        gchar *result = g_strdup(resolved);
+
+        free(resolved);
+        return result;
+    }
+#endif
+
+    return g_strdup(filename);
+}
+
+/* Give the temporary file the permissions (and, where allowed, the owner)
+ * of the file it is going to replace */
+void async_writer_copy_mode(const gchar *filename,
+                            gint         fd)
+{
+#ifndef G_OS_WIN32
+    GStatBuf st;
+
+    if (g_stat(filename, &st) != 0) {
+        return;
+    }
+
+    /* Only root may give a file away, so at least try to keep the group */
+    if (fchown(fd, st.st_uid, st.st_gid) != 0 &&
+            fchown(fd, (uid_t)-1, st.st_gid) != 0) {
+        g_debug("Unable to copy the owner of '%s'", filename);
+    }
+    fchmod(fd, st.st_mode & 07777);
+#endif
+}
+
+/* Create a temporary file next to the target and start the writer thread */
+WebPAsyncWriter *async_writer_open(const gchar *filename,
+                                   GError     **error)
+{
+    WebPAsyncWriter *writer;
+    gint             fd;
+
+    writer = g_new0(WebPAsyncWriter, 1);
+    writer->filename     = async_writer_resolve(filename);
+    writer->display_name = g_filename_display_name(filename);
+    writer->tmp_filename = g_strdup_printf("%s.XXXXXX", writer->filename);
+    writer->pending      = -1;
+
+    /* The target itself is left untouched until the output is complete */
+    fd = g_mkstemp_full(writer->tmp_filename, O_RDWR | O_BINARY, 0666);
+    if (fd != -1) {
+        async_writer_copy_mode(writer->filename, fd);
+    }
+    if (fd == -1 || (writer->file = fdopen(fd, "wb")) == NULL) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Unable to open '%s' for writing",
+                    writer->display_name);
+        if (fd != -1) {
+            close(fd);
+            g_unlink(writer->tmp_filename);
+        }
+        g_free(writer->tmp_filename);
+        g_free(writer->display_name);
+        g_free(writer->filename);
+        g_free(writer);
+        return NULL;
+    }
+
+    writer->buffers[0] = g_malloc(ASYNC_WRITER_BUFFER_SIZE);
+    writer->buffers[1] = g_malloc(ASYNC_WRITER_BUFFER_SIZE);
+
+    g_mutex_init(&writer->mutex);
+    g_cond_init(&writer->cond);
+
+    writer->thread = g_thread_new("webp-writer", async_writer_thread, writer);
+
+    return writer;
+}
+
+/* Queue data for writing, blocking only if both buffers are full */
+gboolean async_writer_write(WebPAsyncWriter *writer,
+                            const uint8_t   *data,
+                            size_t           data_size)
+{
+    writer->total += data_size;
+
+    while (data_size > 0) {
+        gsize count = MIN(data_size, ASYNC_WRITER_BUFFER_SIZE - writer->fill);
+
+        memcpy(writer->buffers[writer->current] + writer->fill, data, count);
+        writer->fill += count;
+        data         += count;
+        data_size    -= count;
+
+        if (writer->fill == ASYNC_WRITER_BUFFER_SIZE &&
+                !async_writer_flush(writer)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Report the failure that made a write or patch return FALSE */
+void async_writer_set_error(WebPAsyncWriter *writer,
+                            GError         **error)
+{
+    gint errsv;
+
+    g_mutex_lock(&writer->mutex);
+    errsv = writer->errsv ? writer->errsv : EIO;
+    g_mutex_unlock(&writer->mutex);
+
+    g_set_error(error,
+                G_FILE_ERROR,
+                g_file_error_from_errno(errsv),
+                "Unable to write to '%s': %s",
+                writer->display_name,
+                g_strerror(errsv));
+}
+
+/* Retrieve the number of bytes written so far */
+gsize async_writer_get_size(WebPAsyncWriter *writer)
+{
+    return writer->total;
+}
+
+/* Retrieve the time spent waiting for the writer thread (microseconds) */
+gint64 async_writer_get_wait_time(WebPAsyncWriter *writer)
+{
+    return writer->wait_time;
+}
+
+/* Overwrite data that has already been written - used for filling in
+ * sizes that are only known once everything else has been written */
+gboolean async_writer_patch(WebPAsyncWriter *writer,
+                            long             offset,
+                            const uint8_t   *data,
+                            size_t           data_size)
+{
+    gboolean ok;
+    gint64   start;
+
+    /* Everything up to this point must be in the file first */
+    if (writer->fill > 0 && !async_writer_flush(writer)) {
+        return FALSE;
+    }
+
+    start = g_get_monotonic_time();
+    g_mutex_lock(&writer->mutex);
+
+    /* The thread does not touch the file while it has nothing queued */
+    while (writer->pending >= 0) {
+        g_cond_wait(&writer->cond, &writer->mutex);
+    }
+
+    writer->wait_time += g_get_monotonic_time() - start;
+
+    errno = 0;
+    ok = !writer->errsv &&
+            fseek(writer->file, offset, SEEK_SET) == 0 &&
+            fwrite(data, 1, data_size, writer->file) == data_size &&
+            fseek(writer->file, 0, SEEK_END) == 0;
+
+    if (!ok && !writer->errsv) {
+        writer->errsv = errno ? errno : EIO;
+    }
+
+    g_mutex_unlock(&writer->mutex);
+
+    return ok;
+}
+
+/* Move the temporary file over the target in a single step, so the
+ * target is never missing - sets errno on failure */
+gboolean async_writer_replace(const gchar *tmp_filename,
+                              const gchar *filename)
+{
+#ifdef G_OS_WIN32
+    /* A plain rename does not replace an existing file on Windows */
+    wchar_t *wtmp  = (wchar_t*)g_utf8_to_utf16(tmp_filename, -1, NULL, NULL, NULL);
+    wchar_t *wname = (wchar_t*)g_utf8_to_utf16(filename, -1, NULL, NULL, NULL);
+    gboolean ok    = wtmp && wname &&
+                     MoveFileExW(wtmp, wname,
+                                 MOVEFILE_REPLACE_EXISTING |
+                                 MOVEFILE_WRITE_THROUGH);
+
+    if (!ok) {
+        errno = EACCES;
+    }
+
+    g_free(wtmp);
+    g_free(wname);
+
+    return ok;
+#else
+    return g_rename(tmp_filename, filename) == 0;
+#endif
+}
+
+/* Stop the writer thread and either move the temporary file over the
+ * target (once it is safely on disk) or discard it */
+gboolean async_writer_close(WebPAsyncWriter *writer,
+                            gboolean         commit,
+                            GError         **error)
+{
+    gboolean status = commit;
+
+    /* Queue whatever remains in the current buffer */
+    if (commit && writer->fill > 0) {
+        async_writer_flush(writer);
+    }
+
+    g_mutex_lock(&writer->mutex);
+    writer->finish = TRUE;
+    g_cond_broadcast(&writer->cond);
+    g_mutex_unlock(&writer->mutex);
+
+    g_thread_join(writer->thread);
+
+    if (status && writer->errsv) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(writer->errsv),
+                    "Unable to write to '%s': %s",
+                    writer->display_name,
+                    g_strerror(writer->errsv));
+        status = FALSE;
+    }
+
+    /* Make sure the data has reached the disk before it replaces the
+     * original file */
+    if (status && (fflush(writer->file) != 0 ||
+                   fsync(fileno(writer->file)) != 0)) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Unable to write to '%s': %s",
+                    writer->display_name,
+                    g_strerror(errno));
+        status = FALSE;
+    }
+
+    if (fclose(writer->file) != 0 && status) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Unable to write to '%s': %s",
+                    writer->display_name,
+                    g_strerror(errno));
+        status = FALSE;
+    }
+
+    if (status && !async_writer_replace(writer->tmp_filename,
+                                        writer->filename)) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Unable to replace '%s': %s",
+                    writer->display_name,
+                    g_strerror(errno));
+        status = FALSE;
+    }
+
+    if (!status) {
+        g_unlink(writer->tmp_filename);
+    }
+
+    g_cond_clear(&writer->cond);
+    g_mutex_clear(&writer->mutex);
+    g_free(writer->buffers[0]);
+    g_free(writer->buffers[1]);
+    g_free(writer->tmp_filename);
+    g_free(writer->display_name);
+    g_free(writer->filename);
+    g_free(writer);
+
+    return status;
+}
@@ -0,0 +1,50 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WEBP_WRITER_H__
+#define __WEBP_WRITER_H__
+
+#include <glib.h>
+#include <stdint.h>
+
+typedef struct _WebPAsyncWriter WebPAsyncWriter;
+
+WebPAsyncWriter *async_writer_open(const gchar *filename,
+                                   GError     **error);
+
+gboolean async_writer_write(WebPAsyncWriter *writer,
+                            const uint8_t   *data,
+                            size_t           data_size);
+
+void async_writer_set_error(WebPAsyncWriter *writer,
+                            GError         **error);
+
+gsize async_writer_get_size(WebPAsyncWriter *writer);
+
+gint64 async_writer_get_wait_time(WebPAsyncWriter *writer);
+
+gboolean async_writer_patch(WebPAsyncWriter *writer,
+                            long             offset,
+                            const uint8_t   *data,
+                            size_t           data_size);
+
+gboolean async_writer_close(WebPAsyncWriter *writer,
+                            gboolean         commit,
+                            GError         **error);
+
+#endif /* __WEBP_WRITER_H__ */
@@ -29,7 +29,10 @@
 
 const char BINARY_NAME[]    = "file-webp";
 const char LOAD_PROCEDURE[] = "file-webp-load";
+const char THUMB_PROCEDURE[] = "file-webp-load-thumb";
+const char REGION_PROCEDURE[] = "file-webp-load-region";
 const char SAVE_PROCEDURE[] = "file-webp-save";
+const char BATCH_PROCEDURE[] = "file-webp-save-batch";
 
 /* Predeclare our entrypoints. */
 void query();
@@ -52,14 +55,46 @@ void query()
     static const GimpParamDef load_arguments[] = {
         { GIMP_PDB_INT32,  "run-mode",     "Interactive, non-interactive" },
         { GIMP_PDB_STRING, "filename",     "The name of the file to load" },
-        { GIMP_PDB_STRING, "raw-filename", "The name entered" }
+        { GIMP_PDB_STRING, "raw-filename", "The name entered" },
+        { GIMP_PDB_INT32,  "composite",    "Load animation frames as composited canvases (0/1)" }
     };
 
     /* Load return values. */
     static const GimpParamDef load_return_values[] = {
+        { GIMP_PDB_IMAGE,  "image",      "Output image" },
+        { GIMP_PDB_STRING, "statistics", "Time spent in each phase of loading, as JSON" }
+    };
+
+    /* Region load return values. */
+    static const GimpParamDef region_return_values[] = {
         { GIMP_PDB_IMAGE, "image", "Output image" }
     };
 
+    /* Region load arguments. */
+    static const GimpParamDef region_arguments[] = {
+        { GIMP_PDB_INT32,  "run-mode",      "Interactive, non-interactive" },
+        { GIMP_PDB_STRING, "filename",      "The name of the file to load" },
+        { GIMP_PDB_INT32,  "x",             "Left edge of the region" },
+        { GIMP_PDB_INT32,  "y",             "Top edge of the region" },
+        { GIMP_PDB_INT32,  "width",         "Width of the region" },
+        { GIMP_PDB_INT32,  "height",        "Height of the region" },
+        { GIMP_PDB_INT32,  "target-width",  "Width to scale the region to (0 = no scaling)" },
+        { GIMP_PDB_INT32,  "target-height", "Height to scale the region to (0 = no scaling)" }
+    };
+
+    /* Thumbnail arguments. */
+    static const GimpParamDef thumb_arguments[] = {
+        { GIMP_PDB_STRING, "filename",   "The name of the file to load" },
+        { GIMP_PDB_INT32,  "thumb-size", "Preferred thumbnail size" }
+    };
+
+    /* Thumbnail return values. */
+    static const GimpParamDef thumb_return_values[] = {
+        { GIMP_PDB_IMAGE, "image",        "Thumbnail image" },
+        { GIMP_PDB_INT32, "image-width",  "Width of full-sized image" },
+        { GIMP_PDB_INT32, "image-height", "Height of full-sized image" }
+    };
+
     /* Save arguments. */
     static const GimpParamDef save_arguments[] = {
         { GIMP_PDB_INT32,    "run-mode",      "Interactive, non-interactive" },
@@ -73,6 +108,56 @@ void query()
         { GIMP_PDB_FLOAT,    "alpha-quality", "Quality of the image's alpha channel (0 <= alpha-quality <= 100)" },
         { GIMP_PDB_INT32,    "animation",     "Use layers for animation (0/1)" },
         { GIMP_PDB_INT32,    "anim-loop",     "Loop animation infinitely (0/1)" },
+        { GIMP_PDB_INT32,    "use-threads",   "Use multiple threads for encoding (0/1)" },
+        { GIMP_PDB_INT32,    "anim-parallel", "Encode animation frames independently in parallel (0/1)" },
+        { GIMP_PDB_INT32,    "time-budget",   "Encoding time budget in milliseconds (0 = no limit)" },
+        { GIMP_PDB_INT32,    "target-size",   "Target size of the file in bytes (0 = use quality)" },
+        { GIMP_PDB_FLOAT,    "target-psnr",   "Target PSNR in dB (0 = use quality)" },
+        { GIMP_PDB_INT32,    "memory-budget", "Memory the export may use in MiB (0 = no limit)" },
+        { GIMP_PDB_INT32,    "trials",        "Encode lossy and lossless at once and keep the smallest (0/1)" },
+    };
+
+    /* Save return values. */
+    static const GimpParamDef save_return_values[] = {
+        { GIMP_PDB_INT32,  "file-size",   "Number of bytes written" },
+        { GIMP_PDB_FLOAT,  "psnr",        "PSNR of the encoded image in dB (averaged over frames encoded in parallel, 0 for other animations)" },
+        { GIMP_PDB_FLOAT,  "read-time",   "Time spent reading pixels from the image in milliseconds" },
+        { GIMP_PDB_FLOAT,  "import-time", "Time spent converting pixels for the encoder in milliseconds" },
+        { GIMP_PDB_FLOAT,  "encode-time", "Time spent encoding in milliseconds" },
+        { GIMP_PDB_FLOAT,  "mux-time",    "Time spent assembling animations in milliseconds" },
+        { GIMP_PDB_FLOAT,  "write-time",  "Time spent writing the file in milliseconds" },
+        { GIMP_PDB_INT32,  "alpha-size",  "Number of bytes taken up by the alpha channel" },
+        { GIMP_PDB_STRING, "statistics",  "Time spent in each phase and the encoder's statistics, as JSON" },
+        { GIMP_PDB_INT32,  "passes",      "Number of passes allowed for target-size or target-psnr (1 without a target) - libwebp does not report how many it used" }
+    };
+
+    /* Batch save arguments. */
+    static const GimpParamDef batch_arguments[] = {
+        { GIMP_PDB_INT32,       "run-mode",      "Non-interactive" },
+        { GIMP_PDB_INT32,       "num-images",    "Number of images" },
+        { GIMP_PDB_INT32ARRAY,  "images",        "Input images" },
+        { GIMP_PDB_INT32,       "num-drawables", "Number of drawables" },
+        { GIMP_PDB_INT32ARRAY,  "drawables",     "Drawable to save from each image" },
+        { GIMP_PDB_INT32,       "num-filenames", "Number of filenames" },
+        { GIMP_PDB_STRINGARRAY, "filenames",     "The name of the file to save each image to" },
+        { GIMP_PDB_STRING,      "preset",        "Name of preset to use" },
+        { GIMP_PDB_INT32,       "lossless",      "Use lossless encoding (0/1)" },
+        { GIMP_PDB_FLOAT,       "quality",       "Quality of the images (0 <= quality <= 100)" },
+        { GIMP_PDB_FLOAT,       "alpha-quality", "Quality of the images' alpha channels (0 <= alpha-quality <= 100)" },
+        { GIMP_PDB_INT32,       "time-budget",   "Encoding time budget of each image in milliseconds (0 = no limit)" },
+        { GIMP_PDB_INT32,       "target-size",   "Target size of each file in bytes (0 = use quality)" },
+        { GIMP_PDB_FLOAT,       "target-psnr",   "Target PSNR in dB (0 = use quality)" },
+        { GIMP_PDB_INT32,       "memory-budget", "Memory the batch may use in MiB (0 = no limit)" },
+        { GIMP_PDB_INT32,       "trials",        "Encode lossy and lossless at once and keep the smallest (0/1)" }
+    };
+
+    /* Batch save return values. */
+    static const GimpParamDef batch_return_values[] = {
+        { GIMP_PDB_INT32,      "num-statuses", "Number of statuses" },
+        { GIMP_PDB_INT32ARRAY, "statuses",     "Status of each item (GimpPDBStatusType)" },
+        { GIMP_PDB_INT32,      "num-times",    "Number of times" },
+        { GIMP_PDB_FLOATARRAY, "times",        "Time taken by each item in milliseconds" },
+        { GIMP_PDB_STRING,     "error",        "Message naming the files that could not be saved, or an empty string" }
     };
 
     /* Install the load procedure. */
@@ -90,6 +175,38 @@ void query()
                            load_arguments,
                            load_return_values);
 
+    /* Install the region load procedure. */
+    gimp_install_procedure(REGION_PROCEDURE,
+                           "Loads part of an image in the WebP file format",
+                           "Loads a rectangular region of a WebP image, "
+                           "optionally scaled, decoding only that region",
+                           "Nathan Osman & Ben Touchette",
+                           "Copyright (C) 2016  Nathan Osman & Ben Touchette",
+                           "2016",
+                           NULL,
+                           NULL,
+                           GIMP_PLUGIN,
+                           G_N_ELEMENTS(region_arguments),
+                           G_N_ELEMENTS(region_return_values),
+                           region_arguments,
+                           region_return_values);
+
+    /* Install the thumbnail procedure. */
+    gimp_install_procedure(THUMB_PROCEDURE,
+                           "Loads a thumbnail from a WebP image",
+                           "Loads a thumbnail from a WebP image, decoding the "
+                           "first frame directly at the requested size",
+                           "Nathan Osman & Ben Touchette",
+                           "Copyright (C) 2016  Nathan Osman & Ben Touchette",
+                           "2016",
+                           NULL,
+                           NULL,
+                           GIMP_PLUGIN,
+                           G_N_ELEMENTS(thumb_arguments),
+                           G_N_ELEMENTS(thumb_return_values),
+                           thumb_arguments,
+                           thumb_return_values);
+
     /* Install the save procedure. */
     gimp_install_procedure(SAVE_PROCEDURE,
                            "Saves files in the WebP image format",
@@ -101,19 +218,59 @@ void query()
                            "RGB*",
                            GIMP_PLUGIN,
                            G_N_ELEMENTS(save_arguments),
-                           0,
+                           G_N_ELEMENTS(save_return_values),
                            save_arguments,
-                           NULL);
+                           save_return_values);
+
+    /* Install the batch save procedure - this is not a file handler */
+    gimp_install_procedure(BATCH_PROCEDURE,
+                           "Saves several images in the WebP image format",
+                           "Saves the given RGB drawables to their own files "
+                           "in the WebP image format with shared parameters, "
+                           "encoding them concurrently. The call succeeds if "
+                           "any item was saved - the status of each item "
+                           "tells which ones failed",
+                           "Nathan Osman & Ben Touchette",
+                           "Copyright (C) 2016  Nathan Osman & Ben Touchette",
+                           "2016",
+                           NULL,
+                           NULL,
+                           GIMP_PLUGIN,
+                           G_N_ELEMENTS(batch_arguments),
+                           G_N_ELEMENTS(batch_return_values),
+                           batch_arguments,
+                           batch_return_values);
 
     /* Register the load handlers. */
     gimp_register_file_handler_mime(LOAD_PROCEDURE, "image/webp");
     gimp_register_load_handler(LOAD_PROCEDURE, "webp", "");
+    gimp_register_thumbnail_loader(LOAD_PROCEDURE, THUMB_PROCEDURE);
 
     /* Now register the save handlers. */
     gimp_register_file_handler_mime(SAVE_PROCEDURE, "image/webp");
     gimp_register_save_handler(SAVE_PROCEDURE, "webp", "");
 }
 
+/* Initialize save parameters to their defaults */
+void init_save_params(WebPSaveParams *params)
+{
+    params->preset        = "default";
+    params->lossless      = FALSE;
+    params->quality       = 90.0f;
+    params->alpha_quality = 100.0f;
+    params->threads       = TRUE;
+    params->time_budget   = 0;
+    params->target_size   = 0;
+    params->target_psnr   = 0.0f;
+    params->memory_budget = webp_default_memory_budget();
+    params->trials        = FALSE;
+#ifdef WEBP_0_5
+    params->animation     = FALSE;
+    params->loop          = TRUE;
+    params->anim_parallel = FALSE;
+#endif
+}
+
 /* This function is called when one of our methods is invoked. */
 void run(const gchar * name,
          gint nparams,
@@ -121,7 +278,10 @@ void run(const gchar * name,
          gint * nreturn_vals,
          GimpParam ** return_vals)
 {
-    static GimpParam  values[2];
+    static GimpParam  values[11];
+    static gchar     *statistics = NULL;
+    static gint32    *statuses   = NULL;
+    static gdouble   *times      = NULL;
     GimpRunMode       run_mode;
     GimpPDBStatusType status = GIMP_PDB_SUCCESS;
     gint32            image_ID;
@@ -132,8 +292,17 @@ void run(const gchar * name,
     gint32           *allLayers;
 #endif
 
-    /* Determine the current run mode */
-    run_mode = param[0].data.d_int32;
+    /* Determine the current run mode - the thumbnail procedure has none */
+    run_mode = strcmp(name, THUMB_PROCEDURE) ?
+            param[0].data.d_int32 : GIMP_RUN_NONINTERACTIVE;
+
+    /* Free the statistics and arrays returned by the previous call */
+    g_free(statistics);
+    g_free(statuses);
+    g_free(times);
+    statistics = NULL;
+    statuses   = NULL;
+    times      = NULL;
 
     /* Fill in the return values */
     *nreturn_vals = 1;
@@ -147,7 +316,40 @@ void run(const gchar * name,
         /* No need to determine whether the plugin is being invoked
          * interactively here since we don't need a UI for loading */
 
-        if(load_image(param[1].data.d_string, &image_ID, &error) == TRUE) {
+        /* Animations are loaded as raw frames unless asked otherwise -
+         * the file dialog only supplies the first three parameters */
+        gboolean  composite = nparams > 3 ? param[3].data.d_int32 : FALSE;
+        WebPStats stats;
+
+        if(load_image(param[1].data.d_string, composite, &image_ID, &stats, &error) == TRUE) {
+
+            statistics = stats_to_json("load", param[1].data.d_string,
+                                       -1, &stats);
+
+            /* Return the new image that was loaded */
+            *nreturn_vals = 3;
+            values[1].type          = GIMP_PDB_IMAGE;
+            values[1].data.d_image  = image_ID;
+            values[2].type          = GIMP_PDB_STRING;
+            values[2].data.d_string = statistics;
+
+        } else {
+            status = GIMP_PDB_EXECUTION_ERROR;
+        }
+
+    } else if(!strcmp(name, REGION_PROCEDURE)) {
+
+        if(nparams != 8) {
+            status = GIMP_PDB_CALLING_ERROR;
+        } else if(load_region_image(param[1].data.d_string,
+                                    param[2].data.d_int32,
+                                    param[3].data.d_int32,
+                                    param[4].data.d_int32,
+                                    param[5].data.d_int32,
+                                    param[6].data.d_int32,
+                                    param[7].data.d_int32,
+                                    &image_ID,
+                                    &error) == TRUE) {
 
             /* Return the new image that was loaded */
             *nreturn_vals = 2;
@@ -158,20 +360,39 @@ void run(const gchar * name,
             status = GIMP_PDB_EXECUTION_ERROR;
         }
 
+    } else if(!strcmp(name, THUMB_PROCEDURE)) {
+
+        gint width;
+        gint height;
+
+        if(load_thumbnail_image(param[0].data.d_string,
+                                param[1].data.d_int32,
+                                &image_ID,
+                                &width,
+                                &height,
+                                &error) == TRUE) {
+
+            /* Return the thumbnail along with the full image size */
+            *nreturn_vals = 4;
+            values[1].type         = GIMP_PDB_IMAGE;
+            values[1].data.d_image = image_ID;
+            values[2].type         = GIMP_PDB_INT32;
+            values[2].data.d_int32 = width;
+            values[3].type         = GIMP_PDB_INT32;
+            values[3].data.d_int32 = height;
+
+        } else {
+            status = GIMP_PDB_EXECUTION_ERROR;
+        }
+
     } else if(!strcmp(name, SAVE_PROCEDURE)) {
 
         WebPSaveParams   params;
+        WebPSaveStats    stats      = {0};
         GimpExportReturn export_ret = GIMP_EXPORT_CANCEL;
 
         /* Initialize the parameters to their defaults */
-        params.preset        = "default";
-        params.lossless      = FALSE;
-        params.quality       = 90.0f;
-        params.alpha_quality = 100.0f;
-#ifdef WEBP_0_5
-        params.animation     = FALSE;
-        params.loop          = TRUE;
-#endif
+        init_save_params(&params);
 
         /* Load the image and drawable IDs */
         image_ID    = param[1].data.d_int32;
@@ -204,6 +425,7 @@ void run(const gchar * name,
             /* Display the dialog */
             if(save_dialog(
                         &params
+                      , drawable_ID
 #ifdef WEBP_0_5
                       , image_ID
                       , nLayers
@@ -219,8 +441,9 @@ void run(const gchar * name,
 
             /* Ensure the correct number of parameters were supplied
                 Note: even if animation support is not available, 11
-                parameters must still be supplied */
-            if(nparams != 11) {
+                parameters must still be supplied - the remaining ones
+                are optional */
+            if(nparams < 11) {
                 status = GIMP_PDB_CALLING_ERROR;
                 break;
             }
@@ -234,6 +457,29 @@ void run(const gchar * name,
             params.animation     = param[9].data.d_int32;
             params.loop          = param[10].data.d_int32;
 #endif
+            if(nparams > 11) {
+                params.threads   = param[11].data.d_int32;
+            }
+#ifdef WEBP_0_5
+            if(nparams > 12) {
+                params.anim_parallel = param[12].data.d_int32;
+            }
+#endif
+            if(nparams > 13) {
+                params.time_budget = param[13].data.d_int32;
+            }
+            if(nparams > 14) {
+                params.target_size = param[14].data.d_int32;
+            }
+            if(nparams > 15) {
+                params.target_psnr = param[15].data.d_float;
+            }
+            if(nparams > 16) {
+                params.memory_budget = param[16].data.d_int32;
+            }
+            if(nparams > 17) {
+                params.trials = param[17].data.d_int32;
+            }
 
             break;
         }
@@ -246,13 +492,121 @@ void run(const gchar * name,
 #endif
                         drawable_ID,
                         &params,
+                        &stats,
                         &error)) {
             status = GIMP_PDB_EXECUTION_ERROR;
+        } else {
+
+            statistics = stats_to_json("save", param[3].data.d_string,
+                                       stats.file_size, &stats.stats);
+
+            /* Report the size reached, the resulting quality and where the
+             * time went */
+            *nreturn_vals = 11;
+            values[1].type          = GIMP_PDB_INT32;
+            values[1].data.d_int32  = stats.file_size;
+            values[2].type          = GIMP_PDB_FLOAT;
+            values[2].data.d_float  = stats_psnr(&stats.stats);
+            values[3].type          = GIMP_PDB_FLOAT;
+            values[3].data.d_float  = stats_time_ms(&stats.stats, STATS_READ);
+            values[4].type          = GIMP_PDB_FLOAT;
+            values[4].data.d_float  = stats_time_ms(&stats.stats, STATS_IMPORT);
+            values[5].type          = GIMP_PDB_FLOAT;
+            values[5].data.d_float  = stats_time_ms(&stats.stats, STATS_ENCODE);
+            values[6].type          = GIMP_PDB_FLOAT;
+            values[6].data.d_float  = stats_time_ms(&stats.stats, STATS_MUX);
+            values[7].type          = GIMP_PDB_FLOAT;
+            values[7].data.d_float  = stats_time_ms(&stats.stats, STATS_WRITE);
+            values[8].type          = GIMP_PDB_INT32;
+            values[8].data.d_int32  = stats.stats.aux.alpha_data_size;
+            values[9].type          = GIMP_PDB_STRING;
+            values[9].data.d_string = statistics;
+            values[10].type         = GIMP_PDB_INT32;
+            values[10].data.d_int32 = stats.passes;
         }
 
 #ifdef WEBP_0_5
         g_free(allLayers);
 #endif
+    } else if(!strcmp(name, BATCH_PROCEDURE)) {
+
+        WebPSaveParams  params;
+        gint            nitems;
+        gint            i;
+
+        init_save_params(&params);
+
+        /* There must be at least one item, and every array must have an
+         * entry for each - the arguments after the first 11 are optional */
+        nitems = param[1].data.d_int32;
+        if(nparams < 11 || nitems < 1 ||
+                param[3].data.d_int32 != nitems ||
+                param[5].data.d_int32 != nitems) {
+            values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+            return;
+        }
+
+        params.preset        = param[7].data.d_string;
+        params.lossless      = param[8].data.d_int32;
+        params.quality       = param[9].data.d_float;
+        params.alpha_quality = param[10].data.d_float;
+        if(nparams > 11) {
+            params.time_budget = param[11].data.d_int32;
+        }
+        if(nparams > 12) {
+            params.target_size = param[12].data.d_int32;
+        }
+        if(nparams > 13) {
+            params.target_psnr = param[13].data.d_float;
+        }
+        if(nparams > 14) {
+            params.memory_budget = param[14].data.d_int32;
+        }
+        if(nparams > 15) {
+            params.trials = param[15].data.d_int32;
+        }
+
+        /* Each drawable must be RGB(A) and belong to the image it is
+         * listed with */
+        for(i = 0; i < nitems; ++i) {
+            if(!gimp_drawable_is_rgb(param[4].data.d_int32array[i]) ||
+                    gimp_item_get_image(param[4].data.d_int32array[i]) !=
+                    param[2].data.d_int32array[i]) {
+                values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+                return;
+            }
+        }
+
+        /* The arrays are handed back to Gimp after the plugin returns and
+         * freed on the next call */
+        statuses = g_new0(gint32, nitems);
+        times    = g_new0(gdouble, nitems);
+
+        gimp_progress_init("Saving WebP images");
+
+        /* The call only fails when no item was saved - otherwise the
+         * statuses tell which items failed, and the error names them */
+        if(save_batch(nitems,
+                      param[4].data.d_int32array,
+                      param[6].data.d_stringarray,
+                      &params,
+                      statuses,
+                      times,
+                      &error)) {
+            *nreturn_vals = 6;
+            values[1].type              = GIMP_PDB_INT32;
+            values[1].data.d_int32      = nitems;
+            values[2].type              = GIMP_PDB_INT32ARRAY;
+            values[2].data.d_int32array = statuses;
+            values[3].type              = GIMP_PDB_INT32;
+            values[3].data.d_int32      = nitems;
+            values[4].type              = GIMP_PDB_FLOATARRAY;
+            values[4].data.d_floatarray = times;
+            values[5].type              = GIMP_PDB_STRING;
+            values[5].data.d_string     = error ? error->message : "";
+        } else {
+            status = GIMP_PDB_EXECUTION_ERROR;
+        }
     }
 
     /* If an error was supplied, include it in the return values */
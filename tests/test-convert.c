@@ -0,0 +1,162 @@
+/**
+ * gimp-webp - WebP Plugin for the GIMP
+ * Copyright (C) 2016  Nathan Osman & Ben Touchette
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Check that every vectorized row converter produces exactly the same
+ * words (and opacity result) as the plain C one */
+
+#include <glib.h>
+#include <string.h>
+
+#include "webp-convert.h"
+
+/* Wide enough to cover every tail length of the 16-pixel NEON loop several
+ * times over, plus the extra pixels the SSSE3 RGB loop leaves */
+#define MAX_WIDTH 67
+
+/* Rows start at each of these byte offsets to catch alignment problems */
+#define MAX_OFFSET 4
+
+void fill_random(guchar *pixels,
+                 gsize   size,
+                 GRand  *rand)
+{
+    gsize i;
+
+    for (i = 0; i < size; ++i) {
+        pixels[i] = (guchar)g_rand_int_range(rand, 0, 256);
+    }
+}
+
+void test_rgb(void)
+{
+    const ConvertKernels *kernels;
+    gint                  count = convert_get_kernels(&kernels);
+    GRand                *rand  = g_rand_new_with_seed(1);
+    gint                  k;
+    gint                  width;
+    gint                  offset;
+
+    for (k = 1; k < count; ++k) {
+        for (width = 0; width <= MAX_WIDTH; ++width) {
+            for (offset = 0; offset < MAX_OFFSET; ++offset) {
+                /* Exactly sized, so reading past the row can be caught by
+                 * memory checkers */
+                guchar   *buffer   = g_malloc(offset + width * 3 + 1);
+                guchar   *src      = buffer + offset;
+                uint32_t *expected = g_new0(uint32_t, width + 1);
+                uint32_t *actual   = g_new0(uint32_t, width + 1);
+
+                fill_random(src, width * 3, rand);
+                expected[width] = actual[width] = 0x12345678u;
+
+                kernels[0].rgb(src, expected, width);
+                kernels[k].rgb(src, actual, width);
+
+                if (memcmp(expected, actual, (width + 1) * sizeof(uint32_t))) {
+                    g_test_message("%s RGB width %d offset %d",
+                                   kernels[k].name, width, offset);
+                    g_test_fail();
+                }
+
+                g_free(actual);
+                g_free(expected);
+                g_free(buffer);
+            }
+        }
+    }
+
+    g_rand_free(rand);
+}
+
+void test_rgba(void)
+{
+    const ConvertKernels *kernels;
+    gint                  count = convert_get_kernels(&kernels);
+    GRand                *rand  = g_rand_new_with_seed(2);
+    gint                  k;
+    gint                  width;
+    gint                  offset;
+    gint                  translucent;
+
+    for (k = 1; k < count; ++k) {
+        for (width = 0; width <= MAX_WIDTH; ++width) {
+            for (offset = 0; offset < MAX_OFFSET; ++offset) {
+                /* Random alpha, then opaque rows with at most one
+                 * translucent pixel at every position */
+                for (translucent = -2; translucent < width; ++translucent) {
+                    guchar   *buffer   = g_malloc(offset + width * 4 + 1);
+                    guchar   *src      = buffer + offset;
+                    uint32_t *expected = g_new0(uint32_t, width + 1);
+                    uint32_t *actual   = g_new0(uint32_t, width + 1);
+                    gboolean  opaque_expected;
+                    gboolean  opaque_actual;
+                    gint      x;
+
+                    fill_random(src, width * 4, rand);
+                    if (translucent > -2) {
+                        for (x = 0; x < width; ++x) {
+                            src[x * 4 + 3] = 0xff;
+                        }
+                        if (translucent >= 0) {
+                            src[translucent * 4 + 3] = 0xfe;
+                        }
+                    }
+                    expected[width] = actual[width] = 0x12345678u;
+
+                    opaque_expected = kernels[0].rgba(src, expected, width);
+                    opaque_actual   = kernels[k].rgba(src, actual, width);
+
+                    if (!opaque_expected != !opaque_actual ||
+                            memcmp(expected, actual,
+                                   (width + 1) * sizeof(uint32_t))) {
+                        g_test_message("%s RGBA width %d offset %d pixel %d",
+                                       kernels[k].name, width, offset,
+                                       translucent);
+                        g_test_fail();
+                    }
+
+                    g_free(actual);
+                    g_free(expected);
+                    g_free(buffer);
+                }
+            }
+        }
+    }
+
+    g_rand_free(rand);
+}
+
+int main(int   argc,
+         char *argv[])
+{
+    const ConvertKernels *kernels;
+    gint                  count;
+    gint                  k;
+
+    g_test_init(&argc, &argv, NULL);
+
+    count = convert_get_kernels(&kernels);
+    for (k = 0; k < count; ++k) {
+        g_test_message("Testing converters: %s", kernels[k].name);
+    }
+
+    g_test_add_func("/convert/rgb", test_rgb);
+    g_test_add_func("/convert/rgba", test_rgba);
+
+    return g_test_run();
+}